@@ -36,7 +36,9 @@ typedef struct Arena {
 
 typedef struct ArenaTemp {
     Arena *arena;
+    ArenaRegion *old_begin;
     ArenaRegion *old_end;
+    ArenaRegion *old_last;  /* last region of the chain, reserve included */
     size_t old_count;
 } ArenaTemp;
 
@@ -49,6 +51,10 @@ extern "C" {
 void arena_init(Arena *a);
 void *arena_alloc(Arena *a, size_t size);
 void *arena_alloc_zero(Arena *a, size_t size);
+/* Resizes 'ptr' (an allocation of 'old_size' bytes). The most recent
+   allocation grows or shrinks in place while its region has room; anything
+   else is copied to a new block and the old bytes stay in the arena. */
+void *arena_realloc(Arena *a, void *ptr, size_t old_size, size_t new_size);
 void arena_reset(Arena *a);
 void arena_free(Arena *a);
 void arena_print_stats(const Arena *a);
@@ -56,6 +62,10 @@ void arena_print_stats(const Arena *a);
 /* Scope-based memory management */
 ArenaTemp arena_temp_begin(Arena *a);
 void arena_temp_end(ArenaTemp temp);
+/* Like arena_temp_end, but also frees the regions allocated since the
+   savepoint instead of keeping them for reuse, so the arena is back to the
+   capacity it had. Use it to undo work that failed. */
+void arena_temp_rollback(ArenaTemp temp);
 
 #ifdef __cplusplus
 }
@@ -179,6 +189,24 @@ void *arena_alloc_zero(Arena *a, size_t size) {
     return ptr;
 }
 
+void *arena_realloc(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(a, new_size);
+
+    ArenaRegion *r = a->end;
+    if (r && (uint8_t *)ptr + old_size == r->data + r->count) {
+        size_t offset = (size_t)((uint8_t *)ptr - r->data);
+        if (new_size <= r->capacity - offset) {
+            r->count = offset + new_size;
+            return ptr;
+        }
+    }
+    if (new_size <= old_size) return ptr;
+
+    void *next = arena_alloc(a, new_size);
+    if (next) memcpy(next, ptr, old_size);
+    return next;
+}
+
 void arena_reset(Arena *a) {
     /* Don't free, just rewind end to begin and reset count */
     if (a->begin) {
@@ -217,8 +245,11 @@ void arena_print_stats(const Arena *a) {
 ArenaTemp arena_temp_begin(Arena *a) {
     ArenaTemp temp;
     temp.arena = a;
+    temp.old_begin = a->begin;
     temp.old_end = a->end;
     temp.old_count = a->end ? a->end->count : 0;
+    temp.old_last = a->end ? a->end : a->begin;
+    while (temp.old_last && temp.old_last->next) temp.old_last = temp.old_last->next;
     return temp;
 }
 
@@ -229,4 +260,29 @@ void arena_temp_end(ArenaTemp temp) {
     }
 }
 
+void arena_temp_rollback(ArenaTemp temp) {
+    /* Keep the region the savepoint points into (or the reset first region) */
+    ArenaRegion *keep = temp.old_end ? temp.old_end : temp.old_begin;
+    if (!keep) {
+        arena_free(temp.arena);
+        return;
+    }
+    /* Reserve regions that already existed stay, emptied. New regions come
+       after them, as regions are only added at the end of the chain. If the
+       old last region was dropped meanwhile, everything past 'keep' goes. */
+    ArenaRegion *last = keep;
+    while (last != temp.old_last && last->next) last = last->next;
+    if (last != temp.old_last) last = keep;
+    for (ArenaRegion *r = keep->next; r && r != last->next; r = r->next) r->count = 0;
+
+    ArenaRegion *curr = last->next;
+    last->next = NULL;
+    while (curr) {
+        ArenaRegion *next = curr->next;
+        free(curr);
+        curr = next;
+    }
+    arena_temp_end(temp);
+}
+
 #endif /* ARENA_IMPLEMENTATION */
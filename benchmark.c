@@ -56,9 +56,18 @@ int main() {
         (void)root;
     }
     double my_time = get_time() - start;
-    arena_free(&a);
-    
     printf("My Lib:  %.4f seconds (Score: %.0f MB/s)\n", my_time, (len * iterations / 1024.0 / 1024.0) / my_time);
+    printf("Tree:    JsonValue %zu bytes, JsonNode %zu bytes; ", sizeof(JsonValue), sizeof(JsonNode));
+    arena_print_stats(&a); // the last parse's tree
+    arena_free(&a);
+
+    // --- Validation only (no Arena, no nodes) ---
+    start = get_time();
+    for (int i = 0; i < iterations; i++) {
+        if (!json_validate(data, len, NULL)) { printf("Error: validation failed\n"); break; }
+    }
+    double validate_time = get_time() - start;
+    printf("Validate: %.4f seconds (Score: %.0f MB/s)\n", validate_time, (len * iterations / 1024.0 / 1024.0) / validate_time);
 
     // --- Verdict ---
     if (my_time < cjson_time) {
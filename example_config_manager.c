@@ -28,13 +28,13 @@ char *read_file(Arena *a, const char *filename, size_t *out_len) {
     return buffer;
 }
 
-// Writes string to file
-void write_file(const char *filename, const char *data) {
+// Streams a JSON tree to a file without building the whole string first
+bool write_file(const char *filename, JsonValue *root) {
     FILE *f = fopen(filename, "w");
-    if (f) {
-        fprintf(f, "%s", data);
-        fclose(f);
-    }
+    if (!f) return false;
+    bool ok = json_write_file(f, root, JSON_WRITE_PRETTY);
+    if (fclose(f) != 0) ok = false;
+    return ok;
 }
 
 /* --- Logic Helpers --- */
@@ -67,6 +67,7 @@ int main() {
         root = json_parse(&a, json_source, len, &err);
         
         if (!root) {
+            json_error_format(&err);
             printf("[!] Error parsing config: %s (Line %d:%d)\n", err.msg, err.line, err.col);
             arena_free(&a);
             return 1;
@@ -109,14 +110,15 @@ int main() {
     printf("    New Launch Count: %.0f\n", count);
 
     // --- Save Back to Disk ---
-    // Note: json_to_string returns a char* allocated in the arena
-    char *output = json_to_string(&a, root, true); // true = Pretty Print
-    
-    write_file(CONFIG_FILE, output);
-    printf("[*] Settings saved to %s\n", CONFIG_FILE);
+    // Pretty-printed straight to the file through a fixed-size buffer
+    if (write_file(CONFIG_FILE, root)) {
+        printf("[*] Settings saved to %s\n", CONFIG_FILE);
+    } else {
+        printf("[!] Failed to save %s\n", CONFIG_FILE);
+    }
 
     // --- Cleanup ---
-    // One line frees the file buffer, the JSON tree, and the output string.
+    // One line frees the file buffer and the JSON tree.
     arena_free(&a); 
     return 0;
 }
@@ -3,7 +3,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <stdarg.h>
+#include <errno.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+typedef int ssize_t;
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#endif
 
 #define MAX_JSON_DEPTH 1000
 
@@ -13,55 +23,50 @@ typedef struct {
     const char *start;
     const char *curr;
     const char *end;
-    int line;
-    int col;
     JsonError *err;
+    JsonRawFilter raw_filter;
+    void *raw_user;
 } ParseState;
 
-static void set_error(ParseState *s, const char *fmt, ...) {
+/* Failing is as cheap as succeeding: only the code and the offset are
+   recorded here. json_error_format() builds the message and line/col. */
+static void set_error(ParseState *s, JsonErrorCode code) {
     if (s->err) {
-        va_list args;
-        va_start(args, fmt);
-        vsnprintf(s->err->msg, sizeof(s->err->msg), fmt, args);
-        va_end(args);
-        s->err->line = s->line;
-        s->err->col = s->col;
-        s->err->offset = s->curr - s->start;
+        s->err->code = code;
+        s->err->offset = (size_t)(s->curr - s->start);
+    }
+}
+
+static void parse_state_init(ParseState *s, const char *input, size_t len, JsonError *err) {
+    s->start = input;
+    s->curr = input;
+    s->end = input + len;
+    s->err = err;
+    s->raw_filter = NULL;
+    s->raw_user = NULL;
+    if (err) {
+        err->code = JSON_OK;
+        err->offset = 0;
+        err->input = input;
+        err->input_len = len;
+        err->msg[0] = '\0';
+        err->line = 0;
+        err->col = 0;
     }
 }
 
 /* --- Internal Helpers --- */
 
-static void advance_fast(ParseState *s, int n) {
+static void advance(ParseState *s, size_t n) {
     s->curr += n;
-    s->col += n;
-}
-
-static void advance(ParseState *s, int n) {
-    for (int i = 0; i < n; i++) {
-        if (s->curr >= s->end) break;
-        if (*s->curr == '\n') {
-            s->line++;
-            s->col = 1;
-        } else {
-            s->col++;
-        }
-        s->curr++;
-    }
 }
 
 static void skip_whitespace(ParseState *s) {
     // STRICT MODE: Only RFC 8259 whitespace allowed (Space, Tab, LineFeed, CR)
     while (s->curr < s->end) {
         char c = *s->curr;
-        if (c == ' ' || c == '\t' || c == '\r') {
-            s->curr++;
-            s->col++;
-        }
-        else if (c == '\n') {
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
             s->curr++;
-            s->line++;
-            s->col = 1;
         }
         else {
             break; 
@@ -69,9 +74,302 @@ static void skip_whitespace(ParseState *s) {
     }
 }
 
+/* --- SIMD Scanning --- */
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#endif
+
+static int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) { x >>= 1; n++; }
+    return n;
+#endif
+}
+
+static int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    while (x) { x &= x - 1; n++; }
+    return n;
+#endif
+}
+
+/* Returns the first byte at or after 'p' that is '"', '\\' or a control
+   character, or 'end' if the range has none. */
+static const char *scan_string_special(const char *p, const char *end) {
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v)); // v <= 0x1F
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return p + ctz64((uint64_t)mask);
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\' || c < 0x20) return p;
+        p++;
+    }
+    return end;
+}
+
+/* One bit per byte of a 64-byte block. '[' / '{' and ']' / '}' differ only
+   in bit 0x20, so each bracket pair is matched with a single compare. */
+typedef struct {
+    uint64_t quote;
+    uint64_t bslash;
+    uint64_t open;
+    uint64_t close;
+} BlockMasks;
+
+static void block_masks(const char *p, BlockMasks *m) {
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    m->quote = m->bslash = m->open = m->close = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i folded = _mm_or_si128(v, case_bit);
+        m->quote  |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (16 * i);
+        m->bslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash)) << (16 * i);
+        m->open   |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(folded, open)) << (16 * i);
+        m->close  |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(folded, close)) << (16 * i);
+    }
+#else
+    m->quote = m->bslash = m->open = m->close = 0;
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = (unsigned char)p[i];
+        uint64_t bit = (uint64_t)1 << i;
+        if (c == '"') m->quote |= bit;
+        else if (c == '\\') m->bslash |= bit;
+        else if ((c | 0x20) == '{') m->open |= bit;
+        else if ((c | 0x20) == '}') m->close |= bit;
+    }
+#endif
+}
+
+/* Bit i of the result is the XOR of bits 0..i of x. */
+static uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/* --- UTF-8 Validation --- */
+
+/* Returns the first byte that starts an ill-formed UTF-8 sequence (overlong
+   forms, surrogates and code points above U+10FFFF included), or NULL. */
+static const char *utf8_find_invalid(const char *start, const char *end) {
+    const unsigned char *p = (const unsigned char *)start;
+    const unsigned char *e = (const unsigned char *)end;
+    while (p < e) {
+#ifdef JSON_SSE2
+        while (e - p >= 16 && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p))) p += 16;
+        if (p >= e) break;
+#endif
+        unsigned char c = *p;
+        if (c < 0x80) { p++; continue; }
+
+        int n;
+        unsigned char lo = 0x80, hi = 0xBF; // range of the first continuation byte
+        if (c >= 0xC2 && c <= 0xDF) n = 1;
+        else if (c == 0xE0) { n = 2; lo = 0xA0; }
+        else if (c >= 0xE1 && c <= 0xEC) n = 2;
+        else if (c == 0xED) { n = 2; hi = 0x9F; }
+        else if (c >= 0xEE && c <= 0xEF) n = 2;
+        else if (c == 0xF0) { n = 3; lo = 0x90; }
+        else if (c >= 0xF1 && c <= 0xF3) n = 3;
+        else if (c == 0xF4) { n = 3; hi = 0x8F; }
+        else return (const char *)p;
+
+        if (e - p <= n) return (const char *)p;
+        if (p[1] < lo || p[1] > hi) return (const char *)p;
+        for (int i = 2; i <= n; i++) {
+            if ((p[i] & 0xC0) != 0x80) return (const char *)p;
+        }
+        p += n + 1;
+    }
+    return NULL;
+}
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define JSON_SSSE3 1
+#define JSON_SSSE3_FN
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+// Built for the baseline ISA: compile the vector path for SSSE3 anyway and
+// pick it at run time.
+#include <tmmintrin.h>
+#define JSON_SSSE3 1
+#define JSON_SSSE3_DISPATCH 1
+#define JSON_SSSE3_FN __attribute__((target("ssse3")))
+#endif
+
+#ifdef JSON_SSSE3
+
+/* Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+   Three 16-entry nibble tables classify every (previous byte, byte) pair;
+   an error bit survives the AND only if all three nibbles agree on it. */
+#define U8_TOO_SHORT  (1 << 0)
+#define U8_TOO_LONG   (1 << 1)
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE  (1 << 3)
+#define U8_SURROGATE  (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS  (1 << 7)
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+JSON_SSSE3_FN static __m128i utf8_nibble_hi(__m128i v) {
+    return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+JSON_SSSE3_FN static __m128i utf8_block_errors(__m128i input, __m128i prev_input) {
+    const __m128i byte_1_high_tbl = _mm_setr_epi8(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        (char)(U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4));
+    const __m128i byte_1_low_tbl = _mm_setr_epi8(
+        (char)(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4),
+        (char)(U8_CARRY | U8_OVERLONG_2),
+        (char)U8_CARRY,
+        (char)U8_CARRY,
+        (char)(U8_CARRY | U8_TOO_LARGE),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000));
+    const __m128i byte_2_high_tbl = _mm_setr_epi8(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(_mm_shuffle_epi8(byte_1_high_tbl, utf8_nibble_hi(prev1)),
+                      _mm_shuffle_epi8(byte_1_low_tbl, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)))),
+        _mm_shuffle_epi8(byte_2_high_tbl, utf8_nibble_hi(input)));
+
+    // A continuation byte is required here exactly when a 3- or 4-byte lead
+    // sits two or three bytes back; TWO_CONTS in 'special' must match that.
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+                                  _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+    __m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23_80, special);
+}
+
+/* Non-zero where the block ends inside a multi-byte sequence. */
+JSON_SSSE3_FN static __m128i utf8_block_incomplete(__m128i input) {
+    const __m128i max_value = _mm_setr_epi8(
+        (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm_subs_epu8(input, max_value);
+}
+
+JSON_SSSE3_FN static bool utf8_valid_simd(const char *p, const char *end) {
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+    char tail[16];
+
+    while (p < end) {
+        __m128i input;
+        if (end - p >= 16) {
+            input = _mm_loadu_si128((const __m128i *)p);
+            p += 16;
+        } else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, p, (size_t)(end - p));
+            input = _mm_loadu_si128((const __m128i *)tail);
+            p = end;
+        }
+
+        if (!_mm_movemask_epi8(input)) {
+            // ASCII block: only a sequence left open by the previous block can fail
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        } else {
+            error = _mm_or_si128(error, utf8_block_errors(input, prev_input));
+            prev_incomplete = utf8_block_incomplete(input);
+        }
+        prev_input = input;
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+static bool utf8_use_simd(void) {
+#ifdef JSON_SSSE3_DISPATCH
+    return __builtin_cpu_supports("ssse3");
+#else
+    return true;
+#endif
+}
+#endif
+
+bool json_utf8_valid(const char *str, size_t len) {
+    if (!str) return false;
+#ifdef JSON_SSSE3
+    if (utf8_use_simd()) return utf8_valid_simd(str, str + len);
+#endif
+    return utf8_find_invalid(str, str + len) == NULL;
+}
+
+/* Locates the first ill-formed byte, or NULL. The vector check decides and
+   the scalar scan only runs to find the offset once something is wrong. */
+static const char *utf8_check(const char *start, const char *end) {
+#ifdef JSON_SSSE3
+    if (utf8_use_simd() && utf8_valid_simd(start, end)) return NULL;
+#endif
+    return utf8_find_invalid(start, end);
+}
+
 static JsonValue *make_value(Arena *a, JsonType type) {
     JsonValue *v = arena_alloc_struct(a, JsonValue);
-    if (v) v->type = type;
+    if (v) {
+        // Arena memory is recycled (reset, rollback), so empty containers must
+        // not inherit a stale head.
+        memset(&v->as, 0, sizeof(v->as));
+        v->type = type;
+    }
     return v;
 }
 
@@ -86,23 +384,23 @@ static bool parse_string(Arena *a, ParseState *s, char **out_str) {
     const char *scan = s->curr;
     bool has_escapes = false;
     
-    while (scan < s->end) {
+    while ((scan = scan_string_special(scan, s->end)) < s->end) {
         char c = *scan;
         if (c == '"') break;
         if (c == '\\') {
             has_escapes = true;
             scan++; 
-            if (scan >= s->end) { set_error(s, "Unterminated escape"); return false; }
+            if (scan >= s->end) { set_error(s, JSON_ERR_UNTERMINATED_ESCAPE); return false; }
         }
-        else if ((unsigned char)c < 0x20) {
-            set_error(s, "Control character in string"); 
+        else {
+            set_error(s, JSON_ERR_CONTROL_CHARACTER); 
             return false;
         }
         scan++;
     }
     
     if (scan >= s->end) {
-        set_error(s, "Unterminated string");
+        set_error(s, JSON_ERR_UNTERMINATED_STRING);
         return false;
     }
 
@@ -114,7 +412,7 @@ static bool parse_string(Arena *a, ParseState *s, char **out_str) {
         memcpy(str, start_content, raw_len);
         str[raw_len] = '\0';
         *out_str = str;
-        advance_fast(s, (int)raw_len + 1); 
+        advance(s, raw_len + 1); 
         return true;
     }
 
@@ -139,13 +437,13 @@ static bool parse_string(Arena *a, ParseState *s, char **out_str) {
                     unsigned int codepoint = 0;
                     for (int i = 0; i < 4; i++) {
                         p++;
-                        if (p >= scan) { set_error(s, "Invalid unicode escape"); return false; }
+                        if (p >= scan) { set_error(s, JSON_ERR_INVALID_UNICODE_ESCAPE); return false; }
                         char c = *p;
                         int val = 0;
                         if      (c >= '0' && c <= '9') val = c - '0';
                         else if (c >= 'a' && c <= 'f') val = c - 'a' + 10;
                         else if (c >= 'A' && c <= 'F') val = c - 'A' + 10;
-                        else { set_error(s, "Invalid unicode escape character"); return false; }
+                        else { set_error(s, JSON_ERR_INVALID_UNICODE_ESCAPE); return false; }
                         codepoint = (codepoint << 4) | val;
                     }
                     if (codepoint <= 0x7F) *out++ = (char)codepoint;
@@ -159,7 +457,7 @@ static bool parse_string(Arena *a, ParseState *s, char **out_str) {
                     }
                     break;
                 }
-                default: set_error(s, "Invalid escape sequence"); return false;
+                default: set_error(s, JSON_ERR_INVALID_ESCAPE); return false;
             }
         } else {
             *out++ = *p;
@@ -168,38 +466,39 @@ static bool parse_string(Arena *a, ParseState *s, char **out_str) {
     }
     *out = '\0';
     *out_str = str;
-    advance(s, (int)(scan - start_content) + 1); 
+    advance(s, (size_t)(scan - start_content) + 1); 
     return true;
 }
 
-static bool is_valid_json_number(const char *cursor, const char *end) {
+/* Returns the end of the RFC 8259 number starting at 'cursor', or NULL if it is malformed. */
+static const char *scan_json_number(const char *cursor, const char *end) {
     const char *p = cursor;
     if (p < end && *p == '-') p++;
-    if (p >= end) return false;
+    if (p >= end) return NULL;
 
     if (*p == '0') {
         p++;
-        if (p < end && (*p == 'x' || *p == 'X')) return false; 
-        if (p < end && isdigit((unsigned char)*p)) return false; 
+        if (p < end && (*p == 'x' || *p == 'X')) return NULL; 
+        if (p < end && isdigit((unsigned char)*p)) return NULL; 
     } else if (isdigit((unsigned char)*p)) {
         while (p < end && isdigit((unsigned char)*p)) p++;
     } else {
-        return false;
+        return NULL;
     }
 
     if (p < end && *p == '.') {
         p++;
-        if (p >= end || !isdigit((unsigned char)*p)) return false;
+        if (p >= end || !isdigit((unsigned char)*p)) return NULL;
         while (p < end && isdigit((unsigned char)*p)) p++;
     }
 
     if (p < end && (*p == 'e' || *p == 'E')) {
         p++;
         if (p < end && (*p == '+' || *p == '-')) p++;
-        if (p >= end || !isdigit((unsigned char)*p)) return false;
+        if (p >= end || !isdigit((unsigned char)*p)) return NULL;
         while (p < end && isdigit((unsigned char)*p)) p++;
     }
-    return true;
+    return p;
 }
 
 static bool parse_number(Arena *a, ParseState *s, double *out_num) {
@@ -227,26 +526,27 @@ static bool parse_number(Arena *a, ParseState *s, double *out_num) {
     if (p == s->end || (*p != '.' && *p != 'e' && *p != 'E')) {
         if (p == start_digits) goto USE_STRTOD; 
         *out_num = fast_val * sign;
-        advance_fast(s, (int)(p - s->curr));
+        advance(s, (size_t)(p - s->curr));
         return true;
     }
 
 USE_STRTOD:
-    if (!is_valid_json_number(s->curr, s->end)) {
-        set_error(s, "Invalid number format");
+    if (!scan_json_number(s->curr, s->end)) {
+        set_error(s, JSON_ERR_INVALID_NUMBER);
         return false;
     }
 
     char *endptr;
     *out_num = strtod(s->curr, &endptr);
-    int len = (int)(endptr - s->curr);
-    advance(s, len);
+    advance(s, (size_t)(endptr - s->curr));
     return true;
 }
 
+static bool parse_child(Arena *a, ParseState *s, const char *key, JsonValue **out_val, int depth);
+
 static bool parse_array(Arena *a, ParseState *s, JsonValue *arr, int depth) {
     if (depth > MAX_JSON_DEPTH) {
-        set_error(s, "Maximum JSON depth exceeded");
+        set_error(s, JSON_ERR_MAX_DEPTH);
         return false;
     }
 
@@ -261,7 +561,7 @@ static bool parse_array(Arena *a, ParseState *s, JsonValue *arr, int depth) {
     JsonNode **tail = &arr->as.list.head;
     while (s->curr < s->end) {
         JsonValue *elem;
-        if (!parse_element(a, s, &elem, depth + 1)) return false;
+        if (!parse_child(a, s, NULL, &elem, depth + 1)) return false;
         
         JsonNode *node = arena_alloc_struct(a, JsonNode);
         if (!node) return false; 
@@ -272,7 +572,7 @@ static bool parse_array(Arena *a, ParseState *s, JsonValue *arr, int depth) {
         tail = &node->next;
 
         skip_whitespace(s);
-        if (s->curr >= s->end) { set_error(s, "Unexpected end of input in array"); return false; }
+        if (s->curr >= s->end) { set_error(s, JSON_ERR_UNEXPECTED_END_IN_ARRAY); return false; }
         
         if (*s->curr == ']') {
             advance(s, 1);
@@ -282,21 +582,21 @@ static bool parse_array(Arena *a, ParseState *s, JsonValue *arr, int depth) {
             advance(s, 1);
             skip_whitespace(s);
             if (*s->curr == ']') {
-                set_error(s, "Trailing comma in array");
+                set_error(s, JSON_ERR_TRAILING_COMMA_IN_ARRAY);
                 return false;
             }
         } else {
-            set_error(s, "Expected ',' or ']'");
+            set_error(s, JSON_ERR_EXPECTED_COMMA_OR_BRACKET);
             return false;
         }
     }
-    set_error(s, "Unclosed array");
+    set_error(s, JSON_ERR_UNCLOSED_ARRAY);
     return false;
 }
 
 static bool parse_object(Arena *a, ParseState *s, JsonValue *obj, int depth) {
     if (depth > MAX_JSON_DEPTH) {
-        set_error(s, "Maximum JSON depth exceeded");
+        set_error(s, JSON_ERR_MAX_DEPTH);
         return false;
     }
 
@@ -311,7 +611,7 @@ static bool parse_object(Arena *a, ParseState *s, JsonValue *obj, int depth) {
     JsonNode **tail = &obj->as.list.head;
     while (s->curr < s->end) {
         if (*s->curr != '"') {
-            set_error(s, "Expected string key");
+            set_error(s, JSON_ERR_EXPECTED_KEY);
             return false;
         }
 
@@ -320,13 +620,13 @@ static bool parse_object(Arena *a, ParseState *s, JsonValue *obj, int depth) {
 
         skip_whitespace(s);
         if (s->curr >= s->end || *s->curr != ':') {
-            set_error(s, "Expected ':' after key");
+            set_error(s, JSON_ERR_EXPECTED_COLON);
             return false;
         }
         advance(s, 1); 
 
         JsonValue *val;
-        if (!parse_element(a, s, &val, depth + 1)) return false;
+        if (!parse_child(a, s, key, &val, depth + 1)) return false;
 
         JsonNode *node = arena_alloc_struct(a, JsonNode);
         if (!node) return false; 
@@ -338,7 +638,7 @@ static bool parse_object(Arena *a, ParseState *s, JsonValue *obj, int depth) {
         tail = &node->next;
 
         skip_whitespace(s);
-        if (s->curr >= s->end) { set_error(s, "Unexpected end of input in object"); return false; }
+        if (s->curr >= s->end) { set_error(s, JSON_ERR_UNEXPECTED_END_IN_OBJECT); return false; }
 
         if (*s->curr == '}') {
             advance(s, 1);
@@ -348,22 +648,22 @@ static bool parse_object(Arena *a, ParseState *s, JsonValue *obj, int depth) {
             advance(s, 1);
             skip_whitespace(s);
             if (*s->curr == '}') {
-                set_error(s, "Trailing comma in object");
+                set_error(s, JSON_ERR_TRAILING_COMMA_IN_OBJECT);
                 return false;
             }
         } else {
-            set_error(s, "Expected ',' or '}'");
+            set_error(s, JSON_ERR_EXPECTED_COMMA_OR_BRACE);
             return false;
         }
     }
-    set_error(s, "Unclosed object");
+    set_error(s, JSON_ERR_UNCLOSED_OBJECT);
     return false;
 }
 
 static bool parse_element(Arena *a, ParseState *s, JsonValue **out_val, int depth) {
     skip_whitespace(s);
     if (s->curr >= s->end) {
-        set_error(s, "Unexpected end of input");
+        set_error(s, JSON_ERR_UNEXPECTED_END);
         return false;
     }
 
@@ -409,41 +709,430 @@ static bool parse_element(Arena *a, ParseState *s, JsonValue **out_val, int dept
         return true;
     }
     
-    set_error(s, "Unexpected character '%c'", c);
+    set_error(s, JSON_ERR_UNEXPECTED_CHARACTER);
+    return false;
+}
+
+static bool skip_element(ParseState *s, int depth);
+
+/* Copies the validated text of the value at s->curr as a JSON_RAW value. */
+static bool parse_raw(Arena *a, ParseState *s, JsonValue **out_val, int depth) {
+    skip_whitespace(s);
+    const char *begin = s->curr;
+    if (!skip_element(s, depth)) return false;
+
+    size_t len = (size_t)(s->curr - begin);
+    *out_val = make_value(a, JSON_RAW);
+    if (!*out_val) return false;
+    char *text = arena_alloc_array(a, char, len + 1);
+    if (!text) return false;
+    memcpy(text, begin, len);
+    text[len] = '\0';
+    (*out_val)->as.raw.ptr = text;
+    (*out_val)->as.raw.len = len;
+    return true;
+}
+
+/* An array element or object member value; kept raw if the filter asks. */
+static bool parse_child(Arena *a, ParseState *s, const char *key, JsonValue **out_val, int depth) {
+    if (s->raw_filter && s->raw_filter(s->raw_user, key, depth)) {
+        return parse_raw(a, s, out_val, depth);
+    }
+    return parse_element(a, s, out_val, depth);
+}
+
+/* Rejects ill-formed UTF-8 up front when requested. Outside of strings the
+   grammar only admits ASCII, so checking the whole input checks every string. */
+static bool check_encoding(ParseState *s, unsigned flags) {
+    if (!(flags & JSON_PARSE_VALIDATE_UTF8)) return true;
+    const char *bad = utf8_check(s->start, s->end);
+    if (!bad) return true;
+    s->curr = bad;
+    set_error(s, JSON_ERR_INVALID_UTF8);
     return false;
 }
 
 JsonValue *json_parse(Arena *a, const char *input, size_t len, JsonError *err) {
+    return json_parse_ex(a, input, len, JSON_PARSE_DEFAULT, err);
+}
+
+JsonValue *json_parse_ex(Arena *a, const char *input, size_t len, unsigned flags, JsonError *err) {
+    return json_parse_raw(a, input, len, flags, NULL, NULL, err);
+}
+
+JsonValue *json_parse_raw(Arena *a, const char *input, size_t len, unsigned flags,
+                          JsonRawFilter filter, void *user, JsonError *err) {
     if (!a) return NULL;        
     if (!input) return NULL;    
     if (len == 0) return NULL;  
 
-    if (err) {
-        memset(err, 0, sizeof(JsonError));
-    }
+    ParseState s;
+    parse_state_init(&s, input, len, err);
+    s.raw_filter = filter;
+    s.raw_user = user;
+
+    if (!check_encoding(&s, flags)) return NULL;
 
-    ParseState s = {0};
-    s.start = input;
-    s.curr = input;
-    s.end = input + len;
-    s.line = 1;
-    s.col = 1;
-    s.err = err;
+    // A rejected document must not leave its partial tree in a long-lived arena
+    ArenaTemp mark = arena_temp_begin(a);
 
     JsonValue *root;
     if (!parse_element(a, &s, &root, 0)) {
+        arena_temp_rollback(mark);
         return NULL;
     }
     
     skip_whitespace(&s);
     if (s.curr != s.end) {
-        set_error(&s, "Unexpected garbage after JSON data");
+        set_error(&s, JSON_ERR_TRAILING_GARBAGE);
+        arena_temp_rollback(mark);
         return NULL;
     }
 
     return root;
 }
 
+/* --- Value Skipping --- */
+
+static bool skip_string(ParseState *s) {
+    const char *p = s->curr + 1;
+    for (;;) {
+        p = scan_string_special(p, s->end);
+        if (p >= s->end) { set_error(s, JSON_ERR_UNTERMINATED_STRING); return false; }
+
+        unsigned char c = (unsigned char)*p;
+        if (c == '"') break;
+        if (c < 0x20) { set_error(s, JSON_ERR_CONTROL_CHARACTER); return false; }
+
+        p++;
+        if (p >= s->end) { set_error(s, JSON_ERR_UNTERMINATED_ESCAPE); return false; }
+        switch (*p) {
+            case '"': case '\\': case '/': case 'b':
+            case 'f': case 'n': case 'r': case 't':
+                p++;
+                break;
+            case 'u':
+                for (int i = 0; i < 4; i++) {
+                    p++;
+                    if (p >= s->end || !isxdigit((unsigned char)*p)) {
+                        set_error(s, JSON_ERR_INVALID_UNICODE_ESCAPE);
+                        return false;
+                    }
+                }
+                p++;
+                break;
+            default: set_error(s, JSON_ERR_INVALID_ESCAPE); return false;
+        }
+    }
+    advance(s, (size_t)(p + 1 - s->curr));
+    return true;
+}
+
+static bool skip_array(ParseState *s, int depth) {
+    if (depth > MAX_JSON_DEPTH) {
+        set_error(s, JSON_ERR_MAX_DEPTH);
+        return false;
+    }
+
+    advance(s, 1);
+    skip_whitespace(s);
+
+    if (s->curr < s->end && *s->curr == ']') {
+        advance(s, 1);
+        return true;
+    }
+
+    while (s->curr < s->end) {
+        if (!skip_element(s, depth + 1)) return false;
+
+        skip_whitespace(s);
+        if (s->curr >= s->end) { set_error(s, JSON_ERR_UNEXPECTED_END_IN_ARRAY); return false; }
+
+        if (*s->curr == ']') {
+            advance(s, 1);
+            return true;
+        }
+        if (*s->curr == ',') {
+            advance(s, 1);
+            skip_whitespace(s);
+            if (s->curr < s->end && *s->curr == ']') {
+                set_error(s, JSON_ERR_TRAILING_COMMA_IN_ARRAY);
+                return false;
+            }
+        } else {
+            set_error(s, JSON_ERR_EXPECTED_COMMA_OR_BRACKET);
+            return false;
+        }
+    }
+    set_error(s, JSON_ERR_UNCLOSED_ARRAY);
+    return false;
+}
+
+static bool skip_object(ParseState *s, int depth) {
+    if (depth > MAX_JSON_DEPTH) {
+        set_error(s, JSON_ERR_MAX_DEPTH);
+        return false;
+    }
+
+    advance(s, 1);
+    skip_whitespace(s);
+
+    if (s->curr < s->end && *s->curr == '}') {
+        advance(s, 1);
+        return true;
+    }
+
+    while (s->curr < s->end) {
+        if (*s->curr != '"') {
+            set_error(s, JSON_ERR_EXPECTED_KEY);
+            return false;
+        }
+        if (!skip_string(s)) return false;
+
+        skip_whitespace(s);
+        if (s->curr >= s->end || *s->curr != ':') {
+            set_error(s, JSON_ERR_EXPECTED_COLON);
+            return false;
+        }
+        advance(s, 1);
+
+        if (!skip_element(s, depth + 1)) return false;
+
+        skip_whitespace(s);
+        if (s->curr >= s->end) { set_error(s, JSON_ERR_UNEXPECTED_END_IN_OBJECT); return false; }
+
+        if (*s->curr == '}') {
+            advance(s, 1);
+            return true;
+        }
+        if (*s->curr == ',') {
+            advance(s, 1);
+            skip_whitespace(s);
+            if (s->curr < s->end && *s->curr == '}') {
+                set_error(s, JSON_ERR_TRAILING_COMMA_IN_OBJECT);
+                return false;
+            }
+        } else {
+            set_error(s, JSON_ERR_EXPECTED_COMMA_OR_BRACE);
+            return false;
+        }
+    }
+    set_error(s, JSON_ERR_UNCLOSED_OBJECT);
+    return false;
+}
+
+/* Validating skip: walks the same grammar as parse_element, building nothing. */
+static bool skip_element(ParseState *s, int depth) {
+    skip_whitespace(s);
+    if (s->curr >= s->end) {
+        set_error(s, JSON_ERR_UNEXPECTED_END);
+        return false;
+    }
+
+    char c = *s->curr;
+    size_t left = (size_t)(s->end - s->curr);
+    if (c == '"') return skip_string(s);
+    if (c == '[') return skip_array(s, depth);
+    if (c == '{') return skip_object(s, depth);
+    if (isdigit((unsigned char)c) || c == '-') {
+        const char *num_end = scan_json_number(s->curr, s->end);
+        if (!num_end) {
+            set_error(s, JSON_ERR_INVALID_NUMBER);
+            return false;
+        }
+        advance(s, (size_t)(num_end - s->curr));
+        return true;
+    }
+    if (left >= 4 && memcmp(s->curr, "true", 4) == 0)  { advance(s, 4); return true; }
+    if (left >= 5 && memcmp(s->curr, "false", 5) == 0) { advance(s, 5); return true; }
+    if (left >= 4 && memcmp(s->curr, "null", 4) == 0)  { advance(s, 4); return true; }
+
+    set_error(s, JSON_ERR_UNEXPECTED_CHARACTER);
+    return false;
+}
+
+/* Structural skip of the array or object at s->curr: 64 bytes at a time,
+   it masks out quoted bytes (honouring backslash escapes) and counts bracket
+   depth until the opening bracket is balanced. Bracket kinds, separators,
+   scalars and string contents are not checked. */
+static bool skip_container_fast(ParseState *s) {
+    const char *p = s->curr;
+    uint64_t in_string = 0;   // all ones if the previous block ended inside a string
+    uint64_t escaped_carry = 0;
+    int64_t depth = 0;
+    char tail[64];
+
+    while (p < s->end) {
+        const char *block = p;
+        size_t avail = (size_t)(s->end - p);
+        if (avail < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p, avail);
+            block = tail;
+        }
+
+        BlockMasks m;
+        block_masks(block, &m);
+
+        // A backslash escapes the following byte unless it is itself escaped.
+        uint64_t escaped = escaped_carry;
+        uint64_t bs = m.bslash & ~escaped_carry;
+        escaped_carry = 0;
+        while (bs) {
+            int i = ctz64(bs);
+            if (i == 63) {
+                escaped_carry = 1;
+                break;
+            }
+            escaped |= (uint64_t)1 << (i + 1);
+            bs &= ~((uint64_t)3 << i);
+        }
+
+        uint64_t strings = prefix_xor(m.quote & ~escaped) ^ in_string;
+        in_string = (uint64_t)0 - (strings >> 63);
+
+        uint64_t open = m.open & ~strings;
+        uint64_t close = m.close & ~strings;
+        if (avail < 64) {
+            uint64_t valid = ((uint64_t)1 << avail) - 1;
+            open &= valid;
+            close &= valid;
+        }
+
+        int n_close = popcount64(close);
+        if (depth - n_close > 0) {
+            depth += popcount64(open) - n_close;
+        } else {
+            uint64_t brackets = open | close;
+            while (brackets) {
+                int i = ctz64(brackets);
+                if (open & ((uint64_t)1 << i)) depth++;
+                else if (--depth == 0) {
+                    s->curr = p + i + 1;
+                    return true;
+                }
+                brackets &= brackets - 1;
+            }
+        }
+        p += avail < 64 ? avail : 64;
+    }
+
+    s->curr = s->end;
+    set_error(s, in_string ? JSON_ERR_UNTERMINATED_STRING : JSON_ERR_UNEXPECTED_END);
+    return false;
+}
+
+const char *json_skip_value(const char *input, size_t len, bool validate, JsonError *err) {
+    if (!input) return NULL;
+    if (len == 0) return NULL;
+
+    ParseState s;
+    parse_state_init(&s, input, len, err);
+
+    skip_whitespace(&s);
+    if (!validate && s.curr < s.end && (*s.curr == '[' || *s.curr == '{')) {
+        if (!skip_container_fast(&s)) return NULL;
+        return s.curr;
+    }
+
+    if (!skip_element(&s, 0)) return NULL;
+    return s.curr;
+}
+
+bool json_validate(const char *input, size_t len, JsonError *err) {
+    return json_validate_ex(input, len, JSON_PARSE_DEFAULT, err);
+}
+
+bool json_validate_ex(const char *input, size_t len, unsigned flags, JsonError *err) {
+    if (!input) return false;
+    if (len == 0) return false;
+
+    ParseState s;
+    parse_state_init(&s, input, len, err);
+
+    if (!check_encoding(&s, flags)) return false;
+    if (!skip_element(&s, 0)) return false;
+
+    skip_whitespace(&s);
+    if (s.curr != s.end) {
+        set_error(&s, JSON_ERR_TRAILING_GARBAGE);
+        return false;
+    }
+    return true;
+}
+
+/* Trims whitespace around the single value in [*json, *json + *len) and
+   checks it with the validating skipper. */
+static bool raw_span(const char **json, size_t *len) {
+    ParseState s;
+    parse_state_init(&s, *json, *len, NULL);
+    skip_whitespace(&s);
+    const char *begin = s.curr;
+    if (!skip_element(&s, 0)) return false;
+    const char *end = s.curr;
+    skip_whitespace(&s);
+    if (s.curr != s.end) return false;
+
+    *json = begin;
+    *len = (size_t)(end - begin);
+    return true;
+}
+
+/* --- Error Reporting --- */
+
+const char *json_error_string(JsonErrorCode code) {
+    switch (code) {
+        case JSON_OK:                           return "No error";
+        case JSON_ERR_UNEXPECTED_END:           return "Unexpected end of input";
+        case JSON_ERR_UNEXPECTED_END_IN_ARRAY:  return "Unexpected end of input in array";
+        case JSON_ERR_UNEXPECTED_END_IN_OBJECT: return "Unexpected end of input in object";
+        case JSON_ERR_UNEXPECTED_CHARACTER:     return "Unexpected character";
+        case JSON_ERR_UNTERMINATED_STRING:      return "Unterminated string";
+        case JSON_ERR_UNTERMINATED_ESCAPE:      return "Unterminated escape";
+        case JSON_ERR_CONTROL_CHARACTER:        return "Control character in string";
+        case JSON_ERR_INVALID_ESCAPE:           return "Invalid escape sequence";
+        case JSON_ERR_INVALID_UNICODE_ESCAPE:   return "Invalid unicode escape";
+        case JSON_ERR_INVALID_NUMBER:           return "Invalid number format";
+        case JSON_ERR_INVALID_UTF8:             return "Invalid UTF-8 sequence";
+        case JSON_ERR_MAX_DEPTH:                return "Maximum JSON depth exceeded";
+        case JSON_ERR_EXPECTED_KEY:             return "Expected string key";
+        case JSON_ERR_EXPECTED_COLON:           return "Expected ':' after key";
+        case JSON_ERR_EXPECTED_COMMA_OR_BRACKET: return "Expected ',' or ']'";
+        case JSON_ERR_EXPECTED_COMMA_OR_BRACE:  return "Expected ',' or '}'";
+        case JSON_ERR_TRAILING_COMMA_IN_ARRAY:  return "Trailing comma in array";
+        case JSON_ERR_TRAILING_COMMA_IN_OBJECT: return "Trailing comma in object";
+        case JSON_ERR_UNCLOSED_ARRAY:           return "Unclosed array";
+        case JSON_ERR_UNCLOSED_OBJECT:          return "Unclosed object";
+        case JSON_ERR_TRAILING_GARBAGE:         return "Unexpected garbage after JSON data";
+    }
+    return "Unknown error";
+}
+
+const char *json_error_format(JsonError *err) {
+    if (!err) return "";
+
+    err->line = 1;
+    err->col = 1;
+    if (err->input) {
+        size_t end = err->offset < err->input_len ? err->offset : err->input_len;
+        for (size_t i = 0; i < end; i++) {
+            if (err->input[i] == '\n') {
+                err->line++;
+                err->col = 1;
+            } else {
+                err->col++;
+            }
+        }
+    }
+
+    if (err->code == JSON_ERR_UNEXPECTED_CHARACTER && err->input && err->offset < err->input_len) {
+        snprintf(err->msg, sizeof(err->msg), "Unexpected character '%c'", err->input[err->offset]);
+    } else {
+        snprintf(err->msg, sizeof(err->msg), "%s", json_error_string(err->code));
+    }
+    return err->msg;
+}
+
 /* --- Helpers --- */
 
 JsonValue *json_get(JsonValue *obj, const char *key) {
@@ -481,6 +1170,7 @@ void json_print(JsonValue *v, int indent) {
         case JSON_BOOL:   printf("%s\n", v->as.boolean ? "true" : "false"); break;
         case JSON_NUMBER: printf("%g\n", v->as.number); break;
         case JSON_STRING: printf("\"%s\"\n", v->as.string); break;
+        case JSON_RAW:    printf("%.*s\n", (int)v->as.raw.len, v->as.raw.ptr); break;
         case JSON_ARRAY: {
             printf("[\n");
             JsonNode *curr = v->as.list.head;
@@ -508,225 +1198,3602 @@ void json_print(JsonValue *v, int indent) {
     }
 }
 
-/* --- Serializer / Writer --- */
-
 #include <math.h> 
 
-static void w_str(char *buf, size_t *pos, const char *s) {
-    size_t len = strlen(s);
-    if (buf) memcpy(buf + *pos, s, len);
-    *pos += len;
-}
-
-static void w_char(char *buf, size_t *pos, char c) {
-    if (buf) buf[*pos] = c;
-    (*pos)++;
-}
-
-static void w_escaped_string(char *buf, size_t *pos, const char *s) {
-    w_char(buf, pos, '"');
-    while (*s) {
-        unsigned char c = (unsigned char)*s;
-        if (c == '"')  w_str(buf, pos, "\\\"");
-        else if (c == '\\') w_str(buf, pos, "\\\\");
-        else if (c == '\b') w_str(buf, pos, "\\b");
-        else if (c == '\f') w_str(buf, pos, "\\f");
-        else if (c == '\n') w_str(buf, pos, "\\n");
-        else if (c == '\r') w_str(buf, pos, "\\r");
-        else if (c == '\t') w_str(buf, pos, "\\t");
-        else if (c < 0x20) {
-            char hex[7];
-            sprintf(hex, "\\u00%02X", c);
-            w_str(buf, pos, hex);
-        } else {
-            w_char(buf, pos, (char)c);
-        }
-        s++;
-    }
-    w_char(buf, pos, '"');
-}
+/* --- Number Formatting --- */
 
-static void json_write_internal(JsonValue *v, char *buf, size_t *pos, int indent, bool pretty) {
-    if (!v) return;
+/* Shortest round-trip double to text: Grisu2 (Loitsch, "Printing
+   Floating-Point Numbers Quickly and Accurately with Integers", 2010) in the
+   variant used by RapidJSON. The digits always read back as the same double
+   and are the shortest such string in all but a tiny fraction of cases. */
 
-    switch (v->type) {
-        case JSON_NULL: 
-            w_str(buf, pos, "null"); 
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT_MASK    0x7FF0000000000000ULL
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+
+static const uint64_t kCachedPowersF[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+static const int16_t kCachedPowersE[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874,
+    -847, -821, -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3,
+    30, 56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508, 534,
+    561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986, 1013, 1039,
+    1066
+};
+
+static const uint64_t kPow10U64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static DiyFp diyfp_from_double(double d) {
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    int biased_e = (int)((u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    DiyFp r;
+    r.f = u & DP_SIGNIFICAND_MASK;
+    if (biased_e != 0) {
+        r.f += DP_HIDDEN_BIT;
+        r.e = biased_e - DP_EXPONENT_BIAS;
+    } else {
+        r.e = 1 - DP_EXPONENT_BIAS;
+    }
+    return r;
+}
+
+/* Upper 64 bits of the 128-bit product, rounded. */
+static DiyFp diyfp_mul(DiyFp x, DiyFp y) {
+    DiyFp r;
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    r.f = (uint64_t)(p >> 64);
+    if ((uint64_t)p & (1ULL << 63)) r.f++;
+#else
+    const uint64_t M32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+    tmp += 1ULL << 31;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+#endif
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static DiyFp diyfp_normalize(DiyFp x) {
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* The neighbours halfway to the adjacent doubles, sharing plus's exponent. */
+static void diyfp_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+    DiyFp pl;
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+    pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+    DiyFp mi;
+    if (v.f == DP_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    } else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *plus = pl;
+    *minus = mi;
+}
+
+/* Cached power c = 10^-K such that c * 2^e lands in the digit generation range. */
+static DiyFp cached_power(int e, int *K) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0) k++;
+
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    DiyFp r;
+    r.f = kCachedPowersF[index];
+    r.e = kCachedPowersE[index];
+    return r;
+}
+
+static void grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_digits32(uint32_t n) {
+    if (n < 10) return 1;
+    if (n < 100) return 2;
+    if (n < 1000) return 3;
+    if (n < 10000) return 4;
+    if (n < 100000) return 5;
+    if (n < 1000000) return 6;
+    if (n < 10000000) return 7;
+    if (n < 100000000) return 8;
+    return 9;
+}
+
+static void grisu_digit_gen(DiyFp W, DiyFp Mp, uint64_t delta, char *buffer, int *len, int *K) {
+    DiyFp one;
+    one.f = 1ULL << -Mp.e;
+    one.e = Mp.e;
+    uint64_t wp_w = Mp.f - W.f;
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = count_digits32(p1);
+    *len = 0;
+
+    while (kappa > 0) {
+        uint32_t div = (uint32_t)kPow10U64[kappa - 1];
+        uint32_t d = p1 / div;
+        p1 %= div;
+        if (d || *len) buffer[(*len)++] = (char)('0' + d);
+        kappa--;
+        uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisu_round(buffer, *len, delta, tmp, kPow10U64[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || *len) buffer[(*len)++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            int index = -kappa;
+            grisu_round(buffer, *len, delta, p2, one.f, wp_w * (index < 20 ? kPow10U64[index] : 0));
+            return;
+        }
+    }
+}
+
+/* Digits of a finite, positive value: value ~= digits * 10^K. */
+static void grisu2(double value, char *digits, int *len, int *K) {
+    DiyFp v = diyfp_from_double(value);
+    DiyFp w_m, w_p;
+    diyfp_boundaries(v, &w_m, &w_p);
+
+    DiyFp c_mk = cached_power(w_p.e, K);
+    DiyFp W = diyfp_mul(diyfp_normalize(v), c_mk);
+    DiyFp Wp = diyfp_mul(w_p, c_mk);
+    DiyFp Wm = diyfp_mul(w_m, c_mk);
+    Wm.f++;
+    Wp.f--;
+    grisu_digit_gen(W, Wp, Wp.f - Wm.f, digits, len, K);
+}
+
+/* Grisu3's last-digit check: moves the last digit towards 'w' while it stays
+   in the interval, then fails unless the digits are provably the shortest
+   and the closest. Distances are in units of the last digit's scale. */
+static bool grisu_weed(char *buffer, int len, uint64_t too_high_w, uint64_t unsafe,
+                       uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small = too_high_w - unit;
+    uint64_t big = too_high_w + unit;
+    while (rest < small && unsafe - rest >= ten_kappa &&
+           (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big && unsafe - rest >= ten_kappa &&
+        (rest + ten_kappa < big || big - rest > rest + ten_kappa - big)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/* Grisu3: like grisu2, but generates over the widest interval that may hold
+   the result and returns false, in rare cases, when the digits cannot be
+   proven to be the shortest and the closest to 'value'. */
+static bool grisu3(double value, char *digits, int *len, int *K) {
+    DiyFp v = diyfp_from_double(value);
+    DiyFp w_m, w_p;
+    diyfp_boundaries(v, &w_m, &w_p);
+
+    DiyFp c_mk = cached_power(w_p.e, K);
+    DiyFp W = diyfp_mul(diyfp_normalize(v), c_mk);
+    DiyFp Wp = diyfp_mul(w_p, c_mk);
+    DiyFp Wm = diyfp_mul(w_m, c_mk);
+
+    // The products are off by at most one unit; only digits inside the
+    // narrow interval are safe, and only those in the wide one are possible
+    uint64_t unit = 1;
+    uint64_t too_high = Wp.f + unit;
+    uint64_t unsafe = too_high - (Wm.f - unit);
+    int shift = -Wp.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t integrals = (uint32_t)(too_high >> shift);
+    uint64_t fractionals = too_high & (one - 1);
+    int kappa = count_digits32(integrals);
+    *len = 0;
+
+    while (kappa > 0) {
+        uint32_t div = (uint32_t)kPow10U64[kappa - 1];
+        digits[(*len)++] = (char)('0' + integrals / div);
+        integrals %= div;
+        kappa--;
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe) {
+            *K += kappa;
+            return grisu_weed(digits, *len, too_high - W.f, unsafe, rest, (uint64_t)div << shift, unit);
+        }
+    }
+
+    while (*len < 18) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        digits[(*len)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        kappa--;
+        if (fractionals < unsafe) {
+            *K += kappa;
+            return grisu_weed(digits, *len, (too_high - W.f) * unit, unsafe, fractionals, one, unit);
+        }
+    }
+    return false;
+}
+
+static const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes the decimal digits of u and returns their count. */
+static int fmt_u64(char *out, uint64_t u) {
+    char tmp[20];
+    int n = 0;
+    while (u >= 100) {
+        unsigned pair = (unsigned)(u % 100) * 2;
+        u /= 100;
+        tmp[n++] = kDigitPairs[pair + 1];
+        tmp[n++] = kDigitPairs[pair];
+    }
+    if (u >= 10) {
+        tmp[n++] = kDigitPairs[u * 2 + 1];
+        tmp[n++] = kDigitPairs[u * 2];
+    } else {
+        tmp[n++] = (char)('0' + u);
+    }
+    for (int i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+/* Lays out 'len' digits with decimal exponent 'point' (value = 0.DIGITS *
+   10^point) the way ECMAScript's Number.prototype.toString does. */
+static int fmt_digits(char *out, const char *digits, int len, int point) {
+    char *p = out;
+    if (len <= point && point <= 21) {
+        memcpy(p, digits, (size_t)len);
+        p += len;
+        for (int i = len; i < point; i++) *p++ = '0';
+    } else if (0 < point && point <= 21) {
+        memcpy(p, digits, (size_t)point);
+        p += point;
+        *p++ = '.';
+        memcpy(p, digits + point, (size_t)(len - point));
+        p += len - point;
+    } else if (-6 < point && point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = point; i < 0; i++) *p++ = '0';
+        memcpy(p, digits, (size_t)len);
+        p += len;
+    } else {
+        int exp = point - 1;
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, (size_t)(len - 1));
+            p += len - 1;
+        }
+        *p++ = 'e';
+        *p++ = exp < 0 ? '-' : '+';
+        p += fmt_u64(p, (uint64_t)(exp < 0 ? -exp : exp));
+    }
+    return (int)(p - out);
+}
+
+/* Formats a finite double into 'out' (at least 32 bytes) and returns the
+   length. Integers below 2^53 take a plain integer path. */
+static int fmt_double(char *out, double d) {
+    char *p = out;
+    if (d < 0 || (d == 0 && signbit(d))) {
+        *p++ = '-';
+        d = -d;
+    }
+    if (d < 9007199254740992.0) {
+        uint64_t u = (uint64_t)d;
+        if ((double)u == d) return (int)(p - out) + fmt_u64(p, u);
+    }
+
+    char digits[24];
+    int len, K;
+    grisu2(d, digits, &len, &K);
+    return (int)(p - out) + fmt_digits(p, digits, len, len + K);
+}
+
+/* Correctly rounded 'n'-digit form of 'd' (> 0) from printf; true if it
+   reads back as exactly 'd'. */
+static bool digits_at(double d, int n, char *digits, int *point) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%.*e", n - 1, d);
+    if (strtod(buf, NULL) != d) return false;
+
+    const char *s = buf;
+    for (int i = 0; i < n; s++) {
+        if (*s != '.') digits[i++] = *s;
+    }
+    *point = atoi(s + 1) + 1; // skip the 'e'
+    return true;
+}
+
+/* RFC 8785 numbers: ECMAScript's shortest round-tripping digits, and of
+   those the ones closest to 'd'. Grisu3 finds them directly. When it cannot
+   prove its result, Grisu2 gives a length that round-trips but may not be
+   minimal, and shorter correctly rounded forms from printf are tried until
+   one no longer reads back. -0 is written as 0. */
+static int fmt_double_canonical(char *out, double d) {
+    if (d == 0) {
+        out[0] = '0';
+        return 1;
+    }
+    char *p = out;
+    if (d < 0) {
+        *p++ = '-';
+        d = -d;
+    }
+    if (d < 9007199254740992.0) {
+        uint64_t u = (uint64_t)d;
+        if ((double)u == d) return (int)(p - out) + fmt_u64(p, u);
+    }
+
+    char digits[24];
+    int len, K;
+    if (grisu3(d, digits, &len, &K)) return (int)(p - out) + fmt_digits(p, digits, len, len + K);
+
+    grisu2(d, digits, &len, &K);
+    int point = len + K;
+    digits_at(d, len, digits, &point); // same length, correctly rounded
+    while (len > 1 && digits_at(d, len - 1, digits, &point)) len--;
+    return (int)(p - out) + fmt_digits(p, digits, len, point);
+}
+
+/* --- Serializer / Writer --- */
+
+/* Output buffer for the writer. With an arena it grows geometrically (in place
+   while it is the arena's last allocation). With a sink it is a fixed staging
+   buffer that is handed to the sink whenever it fills up. Otherwise it is a
+   fixed caller buffer, and bytes that do not fit are only counted,
+   snprintf-style. */
+typedef struct TemplateBuild TemplateBuild;
+typedef struct SplitBuild SplitBuild;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t dropped;   // bytes that did not fit
+    size_t flushed;   // bytes already handed to the sink
+    Arena *arena;
+    JsonSinkFn sink;
+    void *sink_user;
+    TemplateBuild *tpl; // set while compiling a template
+    SplitBuild *split;  // set while cutting a tree for the parallel serializer
+    size_t ref_min;   // with a sink, clean runs this long skip the buffer (0 = never)
+    Arena *scratch;   // sort indexes and re-parsed raw text in canonical mode
+    bool canonical;   // RFC 8785: sorted keys, ECMAScript numbers, no NaN/Inf
+    bool failed;      // the arena ran out of memory or the sink failed
+} JsonOut;
+
+static bool out_flush(JsonOut *o) {
+    if (o->failed) return false;
+    if (o->len && !o->sink(o->sink_user, o->buf, o->len)) {
+        o->failed = true;
+        return false;
+    }
+    o->flushed += o->len;
+    o->len = 0;
+    return true;
+}
+
+static bool out_reserve(JsonOut *o, size_t n) {
+    if (o->sink) return out_flush(o) && n <= o->cap;
+    if (!o->arena || o->failed) return false;
+
+    size_t need = o->len + n;
+    size_t cap = o->cap ? o->cap : 256;
+    while (cap < need) cap *= 2;
+
+    char *grown = arena_realloc(o->arena, o->buf, o->cap, cap);
+    if (!grown) {
+        o->failed = true;
+        return false;
+    }
+    o->buf = grown;
+    o->cap = cap;
+    return true;
+}
+
+/* Hands 's' to the sink directly; the staging buffer must be empty. */
+static void out_pass(JsonOut *o, const char *s, size_t n) {
+    if (o->failed) return;
+    if (!o->sink(o->sink_user, s, n)) o->failed = true;
+    else o->flushed += n;
+}
+
+static void out_overflow(JsonOut *o, const char *s, size_t n) {
+    if (o->sink) {
+        // The staging buffer was just flushed; pass oversized writes straight on
+        out_pass(o, s, n);
+        return;
+    }
+    size_t room = o->cap - o->len;
+    if (room) {
+        memcpy(o->buf + o->len, s, room);
+        o->len += room;
+    }
+    o->dropped += n - room;
+}
+
+static void w_mem(JsonOut *o, const char *s, size_t n) {
+    if (o->cap - o->len < n && !out_reserve(o, n)) {
+        out_overflow(o, s, n);
+        return;
+    }
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+/* Bytes that live in the tree itself. Long runs may be passed to the sink in
+   place rather than copied, when the sink keeps a reference (iovec output). */
+static void w_run(JsonOut *o, const char *s, size_t n) {
+    if (o->ref_min && n >= o->ref_min) {
+        if (out_flush(o)) out_pass(o, s, n);
+        return;
+    }
+    w_mem(o, s, n);
+}
+
+static void w_char(JsonOut *o, char c) {
+    if (o->len == o->cap && !out_reserve(o, 1)) {
+        o->dropped++;
+        return;
+    }
+    o->buf[o->len++] = c;
+}
+
+static void w_indent(JsonOut *o, int n) {
+    if (o->cap - o->len < (size_t)n && !out_reserve(o, (size_t)n)) {
+        for (int i = 0; i < n; i++) w_char(o, ' ');
+        return;
+    }
+    memset(o->buf + o->len, ' ', (size_t)n);
+    o->len += (size_t)n;
+}
+
+/* Escape for each byte: 0 = copy as-is, 'u' = \u00XX, else the letter after '\'. */
+static const char kEscapeTable[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    ['\\'] = '\\'
+};
+
+/* Writes the escape sequence for a byte flagged in kEscapeTable into 'dst'
+   (room for 6 bytes) and returns its length. RFC 8785 wants lowercase hex. */
+static int escape_byte(char *dst, unsigned char c, bool lower) {
+    const char *hex = lower ? "0123456789abcdef" : "0123456789ABCDEF";
+    char e = kEscapeTable[c];
+    dst[0] = '\\';
+    if (e != 'u') {
+        dst[1] = e;
+        return 2;
+    }
+    memcpy(dst + 1, "u00", 3);
+    dst[4] = hex[c >> 4];
+    dst[5] = hex[c & 0xF];
+    return 6;
+}
+
+/* Clean runs between bytes that need escaping are found 16 bytes at a time
+   by scan_string_special and copied in bulk. */
+static void w_escaped_run(JsonOut *o, const char *s, size_t len) {
+    const char *end = s + len;
+
+    while (s < end) {
+        const char *special = scan_string_special(s, end);
+        if (special > s) w_run(o, s, (size_t)(special - s));
+        if (special == end) break;
+
+        char seq[6];
+        w_mem(o, seq, (size_t)escape_byte(seq, (unsigned char)*special, o->canonical));
+        s = special + 1;
+    }
+}
+
+static void w_escaped_mem(JsonOut *o, const char *s, size_t len) {
+    w_char(o, '"');
+    w_escaped_run(o, s, len);
+    w_char(o, '"');
+}
+
+static void w_escaped_string(JsonOut *o, const char *s) {
+    w_escaped_mem(o, s, strlen(s));
+}
+
+static bool template_slot(JsonOut *o, const char *str, int depth);
+static bool split_here(JsonOut *o, JsonValue *v, int depth);
+static void write_canonical_object(JsonOut *o, JsonValue *v, int depth);
+static void write_canonical_raw(JsonOut *o, JsonValue *v, int depth);
+
+/* Writes 'v' nested 'depth' levels deep; in pretty mode each level is two spaces. */
+static void json_write_internal(JsonValue *v, JsonOut *o, int depth, bool pretty) {
+    if (!v) return;
+    if (o->split && split_here(o, v, depth)) return;
+
+    switch (v->type) {
+        case JSON_NULL: 
+            w_mem(o, "null", 4); 
             break;
         case JSON_BOOL: 
-            w_str(buf, pos, v->as.boolean ? "true" : "false"); 
+            if (v->as.boolean) w_mem(o, "true", 4);
+            else w_mem(o, "false", 5);
             break;
         case JSON_NUMBER: {
             char num_buf[64];
             if (!isfinite(v->as.number)) {
-                w_str(buf, pos, "null");
+                if (o->canonical) o->failed = true; // RFC 8785 has no null stand-in
+                else w_mem(o, "null", 4);
+            } else if (o->canonical) {
+                w_mem(o, num_buf, (size_t)fmt_double_canonical(num_buf, v->as.number));
             } else {
-                snprintf(num_buf, sizeof(num_buf), "%.17g", v->as.number);
-                w_str(buf, pos, num_buf);
+                w_mem(o, num_buf, (size_t)fmt_double(num_buf, v->as.number));
             }
             break;
         }
         case JSON_STRING: 
-            w_escaped_string(buf, pos, v->as.string); 
+            if (o->tpl && template_slot(o, v->as.string, depth)) break;
+            w_escaped_string(o, v->as.string); 
+            break;
+        case JSON_RAW:
+            if (o->canonical) write_canonical_raw(o, v, depth);
+            else w_run(o, v->as.raw.ptr, v->as.raw.len);
             break;
         case JSON_ARRAY: {
-            w_char(buf, pos, '[');
+            w_char(o, '[');
             if (v->as.list.head) {
-                if (pretty) w_char(buf, pos, '\n');
+                if (pretty) w_char(o, '\n');
                 JsonNode *curr = v->as.list.head;
                 while (curr) {
-                    if (pretty) for (int i = 0; i < indent + 2; i++) w_char(buf, pos, ' ');
-                    json_write_internal(curr->value, buf, pos, indent + (pretty ? 2 : 0), pretty);
+                    if (pretty) w_indent(o, (depth + 1) * 2);
+                    json_write_internal(curr->value, o, depth + 1, pretty);
                     if (curr->next) {
-                        w_char(buf, pos, ',');
-                        if (pretty) w_char(buf, pos, '\n');
+                        w_char(o, ',');
+                        if (pretty) w_char(o, '\n');
                     }
                     curr = curr->next;
                 }
                 if (pretty) {
-                    w_char(buf, pos, '\n');
-                    for (int i = 0; i < indent; i++) w_char(buf, pos, ' ');
+                    w_char(o, '\n');
+                    w_indent(o, depth * 2);
                 }
             }
-            w_char(buf, pos, ']');
+            w_char(o, ']');
             break;
         }
         case JSON_OBJECT: {
-            w_char(buf, pos, '{');
+            if (o->canonical) {
+                write_canonical_object(o, v, depth);
+                break;
+            }
+            w_char(o, '{');
             if (v->as.list.head) {
-                if (pretty) w_char(buf, pos, '\n');
+                if (pretty) w_char(o, '\n');
                 JsonNode *curr = v->as.list.head;
                 while (curr) {
-                    if (pretty) for (int i = 0; i < indent + 2; i++) w_char(buf, pos, ' ');
-                    w_escaped_string(buf, pos, curr->key);
-                    w_str(buf, pos, pretty ? ": " : ":");
-                    json_write_internal(curr->value, buf, pos, indent + (pretty ? 2 : 0), pretty);
+                    if (pretty) w_indent(o, (depth + 1) * 2);
+                    w_escaped_string(o, curr->key);
+                    if (pretty) w_mem(o, ": ", 2);
+                    else w_char(o, ':');
+                    json_write_internal(curr->value, o, depth + 1, pretty);
                     if (curr->next) {
-                        w_char(buf, pos, ',');
-                        if (pretty) w_char(buf, pos, '\n');
+                        w_char(o, ',');
+                        if (pretty) w_char(o, '\n');
                     }
                     curr = curr->next;
                 }
                 if (pretty) {
-                    w_char(buf, pos, '\n');
-                    for (int i = 0; i < indent; i++) w_char(buf, pos, ' ');
+                    w_char(o, '\n');
+                    w_indent(o, depth * 2);
                 }
             }
-            w_char(buf, pos, '}');
+            w_char(o, '}');
             break;
         }
     }
 }
 
+/* Writes a whole document. Canonical mode is always compact, and its sort
+   indexes go to a private scratch arena so they never land between an
+   arena-grown output buffer and the end of its arena. */
+static void write_root(JsonOut *o, JsonValue *v, unsigned flags) {
+    Arena scratch = {0};
+    o->canonical = (flags & JSON_WRITE_CANONICAL) != 0;
+    o->scratch = &scratch;
+    json_write_internal(v, o, 0, !o->canonical && (flags & JSON_WRITE_PRETTY));
+    arena_free(&scratch);
+}
+
 char *json_to_string(Arena *a, JsonValue *v, bool pretty) {
+    return json_to_string_ex(a, v, pretty ? JSON_WRITE_PRETTY : JSON_WRITE_COMPACT, NULL);
+}
+
+char *json_to_string_ex(Arena *a, JsonValue *v, unsigned flags, size_t *out_len) {
     if (!a || !v) return NULL;
 
-    size_t len = 0;
-    json_write_internal(v, NULL, &len, 0, pretty);
-    
-    char *result = arena_alloc_array(a, char, len + 1);
-    if (!result) return NULL;
+    JsonOut o = {0};
+    o.arena = a;
+    write_root(&o, v, flags);
+    w_char(&o, '\0');
+    if (o.failed) return NULL;
 
-    size_t pos = 0;
-    json_write_internal(v, result, &pos, 0, pretty);
-    result[pos] = '\0';
+    // Hand the unused tail of the buffer back to the arena
+    char *result = arena_realloc(a, o.buf, o.cap, o.len);
+    if (out_len) *out_len = o.len - 1;
     return result;
 }
 
-/* --- Builder Implementation --- */
+size_t json_write_buffer(JsonValue *v, unsigned flags, char *buf, size_t cap) {
+    if (!v) return 0;
 
-JsonValue *json_create_null(Arena *a) { 
-    if (!a) return NULL; 
-    return make_value(a, JSON_NULL); 
+    JsonOut o = {0};
+    o.buf = buf;
+    o.cap = cap ? cap - 1 : 0; // keep room for the terminator
+    write_root(&o, v, flags);
+    if (o.failed) o.len = o.dropped = 0;
+    if (cap) buf[o.len] = '\0';
+    return o.len + o.dropped;
 }
-JsonValue *json_create_bool(Arena *a, bool b) { 
-    if (!a) return NULL;
-    JsonValue *v = make_value(a, JSON_BOOL); 
-    if (v) v->as.boolean = b; 
-    return v;
+
+#define JSON_SINK_BUFFER_SIZE (64 * 1024)
+
+static bool sink_fd(void *user, const char *data, size_t len) {
+    int fd = *(int *)user;
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
 }
-JsonValue *json_create_number(Arena *a, double num) {
-    if (!a) return NULL;
-    JsonValue *v = make_value(a, JSON_NUMBER); 
-    if (v) v->as.number = num; 
-    return v;
+
+static bool sink_file(void *user, const char *data, size_t len) {
+    return fwrite(data, 1, len, (FILE *)user) == len;
 }
-JsonValue *json_create_string(Arena *a, const char *str) {
-    if (!a || !str) return NULL;
-    JsonValue *v = make_value(a, JSON_STRING);
-    if (!v) return NULL;
-    size_t len = strlen(str);
-    v->as.string = arena_alloc_array(a, char, len + 1);
-    if (!v->as.string) return NULL;
-    memcpy(v->as.string, str, len + 1);
-    return v;
+
+/* Serializes through a fixed staging buffer, so peak memory does not depend
+   on the size of the document. The buffer comes from a private arena rather
+   than the stack, which may be small on worker threads. */
+static bool write_to_sink(JsonValue *v, unsigned flags, JsonSinkFn sink, void *user) {
+    if (!v) return false;
+
+    Arena staging = {0};
+    JsonOut o = {0};
+    o.buf = arena_alloc_array(&staging, char, JSON_SINK_BUFFER_SIZE);
+    o.cap = JSON_SINK_BUFFER_SIZE;
+    o.sink = sink;
+    o.sink_user = user;
+    bool ok = false;
+    if (o.buf) {
+        write_root(&o, v, flags);
+        ok = out_flush(&o);
+    }
+    arena_free(&staging);
+    return ok;
 }
-JsonValue *json_create_array(Arena *a) { 
-    if (!a) return NULL;
-    return make_value(a, JSON_ARRAY); 
+
+bool json_write_fd(int fd, JsonValue *v, unsigned flags) {
+    return write_to_sink(v, flags, sink_fd, &fd);
 }
-JsonValue *json_create_object(Arena *a) { 
-    if (!a) return NULL;
-    return make_value(a, JSON_OBJECT); 
+
+bool json_write_file(FILE *f, JsonValue *v, unsigned flags) {
+    if (!f) return false;
+    return write_to_sink(v, flags, sink_file, f);
 }
 
-static void json_list_append(Arena *a, JsonValue *parent, const char *key, JsonValue *val) {
-    if (!a || !parent || !val) return; 
+bool json_write_sink(JsonValue *v, unsigned flags, JsonSinkFn sink, void *user) {
+    if (!sink) return false;
+    return write_to_sink(v, flags, sink, user);
+}
 
-    JsonNode *node = arena_alloc_struct(a, JsonNode);
-    if (!node) return; 
+#ifndef _WIN32
 
-    if (key) {
-        size_t len = strlen(key);
-        node->key = arena_alloc_array(a, char, len + 1);
-        if (node->key) memcpy(node->key, key, len + 1);
+#define JSON_IOVEC_CHUNK   4096
+#define JSON_IOVEC_REF_MIN 512
+
+typedef struct {
+    Arena *arena;
+    JsonOut *out;
+    struct iovec *iov;
+    int count;
+    int cap;
+} IovecBuild;
+
+/* Records each piece as an iovec. Pieces of the current chunk are left in
+   place and the chunk keeps filling after them; anything else is a run of
+   the tree referenced where it lies. */
+static bool sink_iovec(void *user, const char *data, size_t len) {
+    IovecBuild *b = user;
+    struct iovec *last = b->count ? &b->iov[b->count - 1] : NULL;
+    if (last && (const char *)last->iov_base + last->iov_len == data) {
+        last->iov_len += len;
     } else {
-        node->key = NULL;
+        if (b->count == b->cap) {
+            int cap = b->cap ? b->cap * 2 : 16;
+            struct iovec *grown = arena_realloc(b->arena, b->iov,
+                                                sizeof(struct iovec) * (size_t)b->cap,
+                                                sizeof(struct iovec) * (size_t)cap);
+            if (!grown) return false;
+            b->iov = grown;
+            b->cap = cap;
+        }
+        b->iov[b->count].iov_base = (void *)data;
+        b->iov[b->count].iov_len = len;
+        b->count++;
     }
-    node->value = val;
-    node->next = NULL;
 
-    if (parent->as.list.head == NULL) {
-        parent->as.list.head = node;
-    } else {
-        JsonNode *curr = parent->as.list.head;
-        while (curr->next) curr = curr->next;
-        curr->next = node;
+    JsonOut *o = b->out;
+    if (data != o->buf) return true;
+    if (o->cap - len >= 256) {
+        o->buf += len;
+        o->cap -= len;
+        return true;
     }
+    o->buf = arena_alloc_array(b->arena, char, JSON_IOVEC_CHUNK);
+    o->cap = JSON_IOVEC_CHUNK;
+    return o->buf != NULL;
 }
 
-void json_add(Arena *a, JsonValue *obj, const char *key, JsonValue *val) {
-    if (!obj || !key || !val) return;
-    if (obj->type == JSON_OBJECT) json_list_append(a, obj, key, val);
+bool json_to_iovec(Arena *a, JsonValue *v, struct iovec **out, int *n) {
+    if (!a || !v || !out || !n) return false;
+    ArenaTemp mark = arena_temp_begin(a);
+
+    JsonOut o = {0};
+    IovecBuild b = { a, &o, NULL, 0, 0 };
+    o.buf = arena_alloc_array(a, char, JSON_IOVEC_CHUNK);
+    o.cap = JSON_IOVEC_CHUNK;
+    o.sink = sink_iovec;
+    o.sink_user = &b;
+    o.ref_min = JSON_IOVEC_REF_MIN;
+    if (!o.buf) return false;
+
+    json_write_internal(v, &o, 0, false);
+    if (!out_flush(&o)) {
+        arena_temp_rollback(mark);
+        return false;
+    }
+    *out = b.iov;
+    *n = b.count;
+    return true;
 }
-void json_add_string(Arena *a, JsonValue *obj, const char *key, const char *val) {
-    if (!val) return;
-    json_add(a, obj, key, json_create_string(a, val));
+
+#endif
+
+/* --- Canonical Form --- */
+
+/* RFC 8785 orders keys by UTF-16 code units. That is UTF-8 byte order except
+   that characters above U+FFFF (surrogate pairs, 0xD800..) come before
+   U+E000..U+FFFF, so only a lead byte 0xF0+ against 0xEE/0xEF needs fixing.
+   Differences past a shared lead byte stay within one range, where byte and
+   code unit order agree. */
+static int utf16_key_cmp(const char *a, const char *b) {
+    const unsigned char *x = (const unsigned char *)a;
+    const unsigned char *y = (const unsigned char *)b;
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    unsigned cx = *x, cy = *y;
+    if (cx == cy) return 0;
+    if (cx >= 0xF0 && (cy == 0xEE || cy == 0xEF)) return -1;
+    if (cy >= 0xF0 && (cx == 0xEE || cx == 0xEF)) return 1;
+    return cx < cy ? -1 : 1;
 }
-void json_add_number(Arena *a, JsonValue *obj, const char *key, double val) {
-    json_add(a, obj, key, json_create_number(a, val));
+
+/* Stable merge sort of member pointers ('tmp' holds n / 2), so duplicate
+   keys keep their document order. */
+static void sort_members(JsonNode **m, JsonNode **tmp, size_t n) {
+    if (n <= 16) {
+        for (size_t i = 1; i < n; i++) {
+            JsonNode *x = m[i];
+            size_t j = i;
+            while (j && utf16_key_cmp(m[j - 1]->key, x->key) > 0) {
+                m[j] = m[j - 1];
+                j--;
+            }
+            m[j] = x;
+        }
+        return;
+    }
+
+    size_t half = n / 2;
+    sort_members(m, tmp, half);
+    sort_members(m + half, tmp, n - half);
+    if (utf16_key_cmp(m[half - 1]->key, m[half]->key) <= 0) return;
+
+    memcpy(tmp, m, half * sizeof(*m));
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        m[k++] = utf16_key_cmp(m[j]->key, tmp[i]->key) < 0 ? m[j++] : tmp[i++];
+    }
+    while (i < half) m[k++] = tmp[i++];
 }
-void json_add_bool(Arena *a, JsonValue *obj, const char *key, bool val) {
-    json_add(a, obj, key, json_create_bool(a, val));
+
+/* Members are written in sorted order through an index array in the scratch
+   arena; the tree itself is left untouched. */
+static void write_canonical_object(JsonOut *o, JsonValue *v, int depth) {
+    size_t n = 0;
+    for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) n++;
+
+    ArenaTemp temp = arena_temp_begin(o->scratch);
+    JsonNode **order = NULL;
+    if (n > 1) {
+        order = arena_alloc_array(o->scratch, JsonNode *, n + n / 2);
+        if (!order) {
+            o->failed = true;
+            arena_temp_end(temp);
+            return;
+        }
+        size_t i = 0;
+        for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) order[i++] = curr;
+        sort_members(order, order + n, n);
+    }
+
+    w_char(o, '{');
+    for (size_t i = 0; i < n; i++) {
+        JsonNode *member = order ? order[i] : v->as.list.head;
+        if (i) w_char(o, ',');
+        w_escaped_string(o, member->key);
+        w_char(o, ':');
+        json_write_internal(member->value, o, depth + 1, false);
+    }
+    w_char(o, '}');
+    arena_temp_end(temp);
 }
-void json_add_null(Arena *a, JsonValue *obj, const char *key) {
-    json_add(a, obj, key, json_create_null(a));
+
+/* Raw text is only as canonical as its source, so it is parsed and written
+   like the rest of the tree. The parsed copy is gone once this returns, so
+   the parallel serializer must not cut tasks out of it. */
+static void write_canonical_raw(JsonOut *o, JsonValue *v, int depth) {
+    ArenaTemp temp = arena_temp_begin(o->scratch);
+    SplitBuild *split = o->split;
+    o->split = NULL;
+    JsonValue *parsed = json_parse(o->scratch, v->as.raw.ptr, v->as.raw.len, NULL);
+    if (parsed) json_write_internal(parsed, o, depth, false);
+    else o->failed = true;
+    o->split = split;
+    arena_temp_end(temp);
 }
 
-void json_append(Arena *a, JsonValue *arr, JsonValue *val) {
-    if (!arr || !val) return;
-    if (arr->type == JSON_ARRAY) json_list_append(a, arr, NULL, val);
+/* SHA-256 (FIPS 180-4), kept here so a canonical digest needs nothing
+   outside the library. */
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + kSha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
 }
-void json_append_string(Arena *a, JsonValue *arr, const char *val) {
-    if (!val) return;
-    json_append(a, arr, json_create_string(a, val));
+
+void json_sha256_init(JsonSha256 *h) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(h->state, iv, sizeof(iv));
+    h->count = 0;
 }
-void json_append_number(Arena *a, JsonValue *arr, double val) {
-    json_append(a, arr, json_create_number(a, val));
+
+bool json_sha256_sink(void *user, const char *data, size_t len) {
+    JsonSha256 *h = user;
+    const unsigned char *p = (const unsigned char *)data;
+    size_t used = (size_t)(h->count & 63);
+    h->count += len;
+
+    if (used) {
+        size_t take = 64 - used < len ? 64 - used : len;
+        memcpy(h->block + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < 64) return true;
+        sha256_block(h->state, h->block);
+    }
+    for (; len >= 64; p += 64, len -= 64) sha256_block(h->state, p);
+    memcpy(h->block, p, len);
+    return true;
+}
+
+void json_sha256_final(JsonSha256 *h, unsigned char digest[32]) {
+    uint64_t bits = h->count * 8;
+    unsigned char pad[72] = {0x80};
+    size_t used = (size_t)(h->count & 63);
+    size_t n = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+    json_sha256_sink(h, (const char *)pad, n + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i]     = (unsigned char)(h->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h->state[i];
+    }
+}
+
+bool json_digest(JsonValue *v, unsigned char digest[32]) {
+    JsonSha256 h;
+    json_sha256_init(&h);
+    if (!json_write_sink(v, JSON_WRITE_CANONICAL, json_sha256_sink, &h)) return false;
+    json_sha256_final(&h, digest);
+    return true;
+}
+
+/* --- Parallel Serializer --- */
+
+/* The tree is cut at one depth into a frame (everything above the cut,
+   serialized once) and tasks (the containers at the cut). Workers measure the
+   tasks, prefix sums give every task its offset in the output, and workers
+   then write each task straight into place. */
+
+#define PARALLEL_TASKS_PER_THREAD 16
+#define PARALLEL_MAX_CUT_DEPTH    8
+#define PARALLEL_CHUNK            8
+
+typedef struct {
+    JsonValue *value;
+    size_t cut;      // offset in the frame text where the task goes
+    size_t size;
+    size_t offset;   // offset in the output
+} SplitTask;
+
+struct SplitBuild {
+    Arena *arena;
+    int depth;
+    SplitTask *tasks;
+    int count;
+    int cap;
+    bool failed;
+};
+
+/* Called by json_write_internal for every value while the frame is written.
+   Containers at the cut depth become tasks and are left out of the frame. */
+static bool split_here(JsonOut *o, JsonValue *v, int depth) {
+    SplitBuild *b = o->split;
+    if (depth != b->depth) return false;
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return false;
+
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        SplitTask *grown = arena_realloc(b->arena, b->tasks,
+                                         sizeof(SplitTask) * (size_t)b->cap,
+                                         sizeof(SplitTask) * (size_t)cap);
+        if (!grown) {
+            b->failed = true;
+            return true;
+        }
+        b->tasks = grown;
+        b->cap = cap;
+    }
+    SplitTask *t = &b->tasks[b->count++];
+    t->value = v;
+    t->cut = o->len;
+    return true;
+}
+
+#ifndef _WIN32
+
+/* Containers exactly 'depth' levels below 'v', counting no further than 'limit'. */
+static size_t count_containers_at(JsonValue *v, int depth, size_t limit) {
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return 0;
+    if (depth == 0) return 1;
+
+    size_t n = 0;
+    for (JsonNode *curr = v->as.list.head; curr && n < limit; curr = curr->next) {
+        n += count_containers_at(curr->value, depth - 1, limit - n);
+    }
+    return n;
+}
+
+typedef struct {
+    SplitTask *tasks;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    char *out;       // NULL while measuring
+    int depth;
+    bool pretty;
+    bool canonical;
+    bool failed;     // a task could not be written (canonical mode only)
+} ParallelJob;
+
+static void *parallel_worker(void *arg) {
+    ParallelJob *job = arg;
+    Arena scratch = {0};
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int begin = job->next;
+        job->next += PARALLEL_CHUNK;
+        pthread_mutex_unlock(&job->lock);
+        if (begin >= job->count) break;
+
+        int end = begin + PARALLEL_CHUNK < job->count ? begin + PARALLEL_CHUNK : job->count;
+        for (int i = begin; i < end; i++) {
+            SplitTask *t = &job->tasks[i];
+            JsonOut o = {0};
+            if (job->out) {
+                o.buf = job->out + t->offset;
+                o.cap = t->size;
+            }
+            o.canonical = job->canonical;
+            o.scratch = &scratch;
+            // Without a buffer every byte is 'dropped', which measures the task
+            json_write_internal(t->value, &o, job->depth, job->pretty);
+            if (!job->out) t->size = o.dropped;
+            if (o.failed) {
+                pthread_mutex_lock(&job->lock);
+                job->failed = true;
+                pthread_mutex_unlock(&job->lock);
+            }
+        }
+    }
+    arena_free(&scratch);
+    return NULL;
+}
+
+/* Runs the job on 'threads' threads, the caller being one of them. */
+static void parallel_run(ParallelJob *job, int threads) {
+    pthread_t ids[64];
+    int started = 0;
+
+    job->next = 0;
+    for (int i = 1; i < threads && started < 64; i++) {
+        if (pthread_create(&ids[started], NULL, parallel_worker, job) != 0) break;
+        started++;
+    }
+    parallel_worker(job);
+    for (int i = 0; i < started; i++) pthread_join(ids[i], NULL);
+}
+
+char *json_to_string_parallel(Arena *a, JsonValue *v, unsigned flags, int threads, size_t *out_len) {
+    if (!a || !v) return NULL;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > 64) threads = 64;
+
+    // Cut where there are enough containers to keep every thread busy
+    size_t want = (size_t)threads * PARALLEL_TASKS_PER_THREAD;
+    int cut = 0;
+    for (int d = 1; d <= PARALLEL_MAX_CUT_DEPTH && threads > 1; d++) {
+        if (count_containers_at(v, d, want) >= want) {
+            cut = d;
+            break;
+        }
+    }
+    if (!cut) return json_to_string_ex(a, v, flags, out_len);
+
+    bool canonical = (flags & JSON_WRITE_CANONICAL) != 0;
+    bool pretty = !canonical && (flags & JSON_WRITE_PRETTY);
+
+    // Frame text and task list grow in 'work', and only the final text goes
+    // into 'a'. Canonical sorting needs its own arena: its temporary scopes
+    // would otherwise cut off a buffer that grew inside them.
+    Arena work = {0}, scratch = {0};
+    SplitBuild b = { &work, cut, NULL, 0, 0, false };
+    JsonOut frame = {0};
+    frame.arena = &work;
+    frame.split = &b;
+    frame.canonical = canonical;
+    frame.scratch = &scratch;
+    json_write_internal(v, &frame, 0, pretty);
+    arena_free(&scratch);
+    if (b.failed || frame.failed) {
+        arena_free(&work);
+        return NULL;
+    }
+
+    ParallelJob job;
+    job.tasks = b.tasks;
+    job.count = b.count;
+    job.out = NULL;
+    job.depth = cut;
+    job.pretty = pretty;
+    job.canonical = canonical;
+    job.failed = false;
+    pthread_mutex_init(&job.lock, NULL);
+    parallel_run(&job, threads);
+    if (job.failed) {
+        pthread_mutex_destroy(&job.lock);
+        arena_free(&work);
+        return NULL;
+    }
+
+    size_t total = frame.len;
+    for (int i = 0; i < b.count; i++) {
+        b.tasks[i].offset = b.tasks[i].cut + (total - frame.len);
+        total += b.tasks[i].size;
+    }
+
+    char *out = arena_alloc_array(a, char, total + 1);
+    if (!out) {
+        pthread_mutex_destroy(&job.lock);
+        arena_free(&work);
+        return NULL;
+    }
+
+    // The frame pieces between tasks are small; copy them while nothing else runs
+    size_t pos = 0;
+    for (int i = 0; i < b.count; i++) {
+        SplitTask *t = &b.tasks[i];
+        memcpy(out + t->offset - (t->cut - pos), frame.buf + pos, t->cut - pos);
+        pos = t->cut;
+    }
+    memcpy(out + total - (frame.len - pos), frame.buf + pos, frame.len - pos);
+    out[total] = '\0';
+
+    job.out = out;
+    parallel_run(&job, threads);
+    pthread_mutex_destroy(&job.lock);
+    arena_free(&work);
+
+    if (out_len) *out_len = total;
+    return out;
+}
+
+#else
+
+char *json_to_string_parallel(Arena *a, JsonValue *v, unsigned flags, int threads, size_t *out_len) {
+    (void)threads;
+    return json_to_string_ex(a, v, flags, out_len);
+}
+
+#endif
+
+/* --- Streaming Writer --- */
+
+enum {
+    WRITER_ARRAY    = 1 << 0,
+    WRITER_OBJECT   = 1 << 1,
+    WRITER_NONEMPTY = 1 << 2
+};
+
+/* Only the open containers are tracked, one byte each, so memory does not
+   grow with the size of the document. */
+struct JsonWriter {
+    JsonOut out;
+    bool pretty;
+    bool misused;     // a call did not fit the document structure
+    bool after_key;   // an object key was written, its value is pending
+    bool complete;    // the top-level value has been written
+    int fd;
+    int depth;
+    unsigned char levels[MAX_JSON_DEPTH];
+};
+
+static JsonWriter *writer_alloc(Arena *a, unsigned flags) {
+    // Canonical output sorts keys, which a stream cannot do
+    if (!a || (flags & JSON_WRITE_CANONICAL)) return NULL;
+    JsonWriter *w = arena_alloc(a, sizeof(JsonWriter));
+    if (!w) return NULL;
+    memset(w, 0, offsetof(JsonWriter, levels));
+    w->pretty = (flags & JSON_WRITE_PRETTY) != 0;
+    return w;
+}
+
+static bool writer_alloc_staging(JsonWriter *w, Arena *a) {
+    w->out.buf = arena_alloc_array(a, char, JSON_SINK_BUFFER_SIZE);
+    w->out.cap = JSON_SINK_BUFFER_SIZE;
+    return w->out.buf != NULL;
+}
+
+JsonWriter *json_writer_new(Arena *a, unsigned flags) {
+    JsonWriter *w = writer_alloc(a, flags);
+    if (w) w->out.arena = a;
+    return w;
+}
+
+JsonWriter *json_writer_new_buffer(Arena *a, char *buf, size_t cap, unsigned flags) {
+    JsonWriter *w = writer_alloc(a, flags);
+    if (!w || !cap) return w;
+    w->out.buf = buf;
+    w->out.cap = cap - 1; // keep room for the terminator
+    return w;
+}
+
+JsonWriter *json_writer_new_sink(Arena *a, JsonSinkFn sink, void *user, unsigned flags) {
+    if (!a || !sink) return NULL;
+    ArenaTemp mark = arena_temp_begin(a);
+    JsonWriter *w = writer_alloc(a, flags);
+    if (!w) return NULL;
+    if (!writer_alloc_staging(w, a)) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+    w->out.sink = sink;
+    w->out.sink_user = user;
+    return w;
+}
+
+JsonWriter *json_writer_new_fd(Arena *a, int fd, unsigned flags) {
+    JsonWriter *w = json_writer_new_sink(a, sink_fd, NULL, flags);
+    if (!w) return NULL;
+    w->fd = fd;
+    w->out.sink_user = &w->fd;
+    return w;
+}
+
+static bool writer_misuse(JsonWriter *w) {
+    w->misused = true;
+    return false;
+}
+
+/* Checks that a value (or, with 'is_key', an object key) may come next and
+   writes the separator and indentation in front of it. */
+static bool writer_prefix(JsonWriter *w, bool is_key) {
+    if (!w || w->misused || w->out.failed) return false;
+
+    if (w->depth == 0) {
+        if (w->complete || is_key) return writer_misuse(w);
+        return true;
+    }
+
+    unsigned char *level = &w->levels[w->depth - 1];
+    bool in_object = (*level & WRITER_OBJECT) != 0;
+    if (w->after_key) {
+        if (is_key) return writer_misuse(w);
+        w->after_key = false;
+        return true;
+    }
+    if (in_object != is_key) return writer_misuse(w);
+
+    if (*level & WRITER_NONEMPTY) w_char(&w->out, ',');
+    *level |= WRITER_NONEMPTY;
+    if (w->pretty) {
+        w_char(&w->out, '\n');
+        w_indent(&w->out, w->depth * 2);
+    }
+    return true;
+}
+
+static bool writer_done(JsonWriter *w) {
+    if (w->depth == 0) w->complete = true;
+    return !w->out.failed;
+}
+
+static bool writer_begin(JsonWriter *w, unsigned char kind, char open) {
+    if (!writer_prefix(w, false)) return false;
+    if (w->depth == MAX_JSON_DEPTH) return writer_misuse(w);
+    w->levels[w->depth++] = kind;
+    w_char(&w->out, open);
+    return !w->out.failed;
+}
+
+static bool writer_end(JsonWriter *w, unsigned char kind, char close) {
+    if (!w || w->misused || w->out.failed) return false;
+    if (w->depth == 0 || w->after_key) return writer_misuse(w);
+
+    unsigned char level = w->levels[w->depth - 1];
+    if (!(level & kind)) return writer_misuse(w);
+    w->depth--;
+    if (w->pretty && (level & WRITER_NONEMPTY)) {
+        w_char(&w->out, '\n');
+        w_indent(&w->out, w->depth * 2);
+    }
+    w_char(&w->out, close);
+    return writer_done(w);
+}
+
+bool json_writer_begin_object(JsonWriter *w) { return writer_begin(w, WRITER_OBJECT, '{'); }
+bool json_writer_end_object(JsonWriter *w)   { return writer_end(w, WRITER_OBJECT, '}'); }
+bool json_writer_begin_array(JsonWriter *w)  { return writer_begin(w, WRITER_ARRAY, '['); }
+bool json_writer_end_array(JsonWriter *w)    { return writer_end(w, WRITER_ARRAY, ']'); }
+
+bool json_writer_key(JsonWriter *w, const char *key) {
+    if (!key) return w ? writer_misuse(w) : false;
+    if (!writer_prefix(w, true)) return false;
+    w_escaped_string(&w->out, key);
+    if (w->pretty) w_mem(&w->out, ": ", 2);
+    else w_char(&w->out, ':');
+    w->after_key = true;
+    return !w->out.failed;
+}
+
+bool json_writer_string(JsonWriter *w, const char *str) {
+    if (!str) return json_writer_null(w);
+    if (!writer_prefix(w, false)) return false;
+    w_escaped_string(&w->out, str);
+    return writer_done(w);
+}
+
+bool json_writer_number(JsonWriter *w, double num) {
+    if (!writer_prefix(w, false)) return false;
+    if (!isfinite(num)) {
+        w_mem(&w->out, "null", 4);
+    } else {
+        char num_buf[64];
+        w_mem(&w->out, num_buf, (size_t)fmt_double(num_buf, num));
+    }
+    return writer_done(w);
+}
+
+bool json_writer_bool(JsonWriter *w, bool b) {
+    if (!writer_prefix(w, false)) return false;
+    if (b) w_mem(&w->out, "true", 4);
+    else w_mem(&w->out, "false", 5);
+    return writer_done(w);
+}
+
+bool json_writer_null(JsonWriter *w) {
+    if (!writer_prefix(w, false)) return false;
+    w_mem(&w->out, "null", 4);
+    return writer_done(w);
+}
+
+bool json_writer_value(JsonWriter *w, JsonValue *v) {
+    if (!v) return json_writer_null(w);
+    if (!writer_prefix(w, false)) return false;
+    json_write_internal(v, &w->out, w->depth, w->pretty);
+    return writer_done(w);
+}
+
+bool json_writer_raw(JsonWriter *w, const char *json, size_t len) {
+    if (!json || !raw_span(&json, &len)) return w ? writer_misuse(w) : false;
+    if (!writer_prefix(w, false)) return false;
+    w_mem(&w->out, json, len);
+    return writer_done(w);
+}
+
+bool json_writer_finish(JsonWriter *w, size_t *out_len) {
+    if (!w) return false;
+
+    bool ok = !w->misused && w->complete;
+    if (w->out.sink) {
+        ok = out_flush(&w->out) && ok;
+    } else if (w->out.arena) {
+        w_char(&w->out, '\0');
+        if (!w->out.failed) w->out.len--;
+    } else {
+        // Caller buffer; with cap 0 there is no buffer and every byte dropped
+        if (w->out.buf) w->out.buf[w->out.len] = '\0';
+        ok = ok && w->out.dropped == 0;
+    }
+    ok = ok && !w->out.failed;
+
+    if (out_len) *out_len = w->out.flushed + w->out.len + w->out.dropped;
+    return ok;
+}
+
+const char *json_writer_text(JsonWriter *w) {
+    if (!w || w->out.sink || !w->out.buf) return NULL;
+    return w->out.buf;
+}
+
+/* --- Resumable Serializer --- */
+
+/* Where a container frame is in writing its members. */
+enum {
+    SER_INDENT,   // before a member: indentation
+    SER_KEY,      // the member's key, in objects
+    SER_VALUE,    // the member's value
+    SER_NEXT,     // after a member: separator, or the closing newline
+    SER_CLOSE     // the closing bracket
+};
+
+typedef struct {
+    JsonNode *node;
+    int phase;
+    bool object;
+} SerFrame;
+
+/* Output is produced one piece at a time (a short token in 'pending', a run
+   of indentation, or a string being escaped) and each piece is drained into
+   the caller's buffer before the next is produced, so nothing larger than a
+   token is ever staged. */
+struct JsonSerializer {
+    Arena *arena;
+    SerFrame *stack;
+    int depth;
+    int stack_cap;
+    bool pretty;
+    bool failed;             // the arena ran out of memory for the stack
+    JsonValue *root;         // not yet started
+
+    char pending[64];
+    int pending_len;
+    int pending_pos;
+    size_t spaces;
+
+    const char *str;         // string being escaped, if any
+    const char *str_end;
+    const char *str_suffix;  // written after the closing quote
+    bool str_raw;            // JSON_RAW text: copied as-is, no quotes
+};
+
+static void ser_pending(JsonSerializer *s, const char *text, int len) {
+    memcpy(s->pending, text, (size_t)len);
+    s->pending_len = len;
+    s->pending_pos = 0;
+}
+
+static void ser_begin_string(JsonSerializer *s, const char *str, const char *suffix) {
+    ser_pending(s, "\"", 1);
+    s->str = str;
+    s->str_end = str + strlen(str);
+    s->str_suffix = suffix;
+    s->str_raw = false;
+}
+
+/* Starts writing a value: scalars and empty containers become one pending
+   token, strings start escaping, other containers push a frame. */
+static void ser_begin_value(JsonSerializer *s, JsonValue *v) {
+    switch (v->type) {
+        case JSON_NULL:
+            ser_pending(s, "null", 4);
+            return;
+        case JSON_BOOL:
+            if (v->as.boolean) ser_pending(s, "true", 4);
+            else ser_pending(s, "false", 5);
+            return;
+        case JSON_NUMBER:
+            if (!isfinite(v->as.number)) {
+                ser_pending(s, "null", 4);
+            } else {
+                s->pending_len = fmt_double(s->pending, v->as.number);
+                s->pending_pos = 0;
+            }
+            return;
+        case JSON_STRING:
+            ser_begin_string(s, v->as.string, "");
+            return;
+        case JSON_RAW:
+            s->str = v->as.raw.ptr;
+            s->str_end = v->as.raw.ptr + v->as.raw.len;
+            s->str_raw = true;
+            return;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            break;
+    }
+
+    bool object = v->type == JSON_OBJECT;
+    if (!v->as.list.head) {
+        ser_pending(s, object ? "{}" : "[]", 2);
+        return;
+    }
+
+    if (s->depth == s->stack_cap) {
+        int cap = s->stack_cap ? s->stack_cap * 2 : 16;
+        SerFrame *grown = arena_realloc(s->arena, s->stack,
+                                        sizeof(SerFrame) * (size_t)s->stack_cap,
+                                        sizeof(SerFrame) * (size_t)cap);
+        if (!grown) {
+            s->failed = true;
+            return;
+        }
+        s->stack = grown;
+        s->stack_cap = cap;
+    }
+    SerFrame *f = &s->stack[s->depth++];
+    f->node = v->as.list.head;
+    f->phase = SER_INDENT;
+    f->object = object;
+
+    if (s->pretty) ser_pending(s, object ? "{\n" : "[\n", 2);
+    else ser_pending(s, object ? "{" : "[", 1);
+}
+
+/* Produces the next piece of output. Returns false when there is none. */
+static bool ser_step(JsonSerializer *s) {
+    if (s->root) {
+        JsonValue *root = s->root;
+        s->root = NULL;
+        ser_begin_value(s, root);
+        return !s->failed;
+    }
+    if (s->depth == 0) return false;
+
+    SerFrame *f = &s->stack[s->depth - 1];
+    switch (f->phase) {
+        case SER_INDENT:
+            if (s->pretty) s->spaces = (size_t)s->depth * 2;
+            f->phase = f->object ? SER_KEY : SER_VALUE;
+            break;
+        case SER_KEY:
+            ser_begin_string(s, f->node->key, s->pretty ? ": " : ":");
+            f->phase = SER_VALUE;
+            break;
+        case SER_VALUE:
+            f->phase = SER_NEXT;
+            ser_begin_value(s, f->node->value);
+            break;
+        case SER_NEXT:
+            f->node = f->node->next;
+            if (f->node) {
+                if (s->pretty) ser_pending(s, ",\n", 2);
+                else ser_pending(s, ",", 1);
+                f->phase = SER_INDENT;
+            } else {
+                if (s->pretty) {
+                    ser_pending(s, "\n", 1);
+                    s->spaces = (size_t)(s->depth - 1) * 2;
+                }
+                f->phase = SER_CLOSE;
+            }
+            break;
+        case SER_CLOSE:
+            ser_pending(s, f->object ? "}" : "]", 1);
+            s->depth--;
+            break;
+    }
+    return !s->failed;
+}
+
+/* Copies clean runs of the current string straight into 'dst' and stages
+   escape sequences and the closing quote in 'pending'. Raw text is copied
+   through unchanged. */
+static size_t ser_string_step(JsonSerializer *s, char *dst, size_t room) {
+    size_t left = (size_t)(s->str_end - s->str);
+    if (s->str_raw) {
+        size_t n = left < room ? left : room;
+        memcpy(dst, s->str, n);
+        s->str += n;
+        if (s->str == s->str_end) s->str = NULL;
+        return n;
+    }
+
+    if (s->str == s->str_end) {
+        size_t suffix = strlen(s->str_suffix);
+        s->pending[0] = '"';
+        memcpy(s->pending + 1, s->str_suffix, suffix);
+        s->pending_len = (int)suffix + 1;
+        s->pending_pos = 0;
+        s->str = NULL;
+        return 0;
+    }
+
+    const char *limit = s->str + (left < room ? left : room);
+    const char *special = scan_string_special(s->str, limit);
+    if (special > s->str) {
+        size_t n = (size_t)(special - s->str);
+        memcpy(dst, s->str, n);
+        s->str = special;
+        return n;
+    }
+
+    s->pending_len = escape_byte(s->pending, (unsigned char)*s->str, false);
+    s->pending_pos = 0;
+    s->str++;
+    return 0;
+}
+
+JsonSerializer *json_serializer_init(Arena *a, JsonValue *root, unsigned flags) {
+    // Canonical output would need a sorted member index per open object
+    if (!a || !root || (flags & JSON_WRITE_CANONICAL)) return NULL;
+    JsonSerializer *s = arena_alloc(a, sizeof(JsonSerializer));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(JsonSerializer));
+    s->arena = a;
+    s->root = root;
+    s->pretty = (flags & JSON_WRITE_PRETTY) != 0;
+    return s;
+}
+
+size_t json_serializer_fill(JsonSerializer *s, char *buf, size_t cap) {
+    if (!s || !buf) return 0;
+
+    size_t n = 0;
+    while (n < cap) {
+        if (s->pending_pos < s->pending_len) {
+            size_t chunk = (size_t)(s->pending_len - s->pending_pos);
+            if (chunk > cap - n) chunk = cap - n;
+            memcpy(buf + n, s->pending + s->pending_pos, chunk);
+            s->pending_pos += (int)chunk;
+            n += chunk;
+        } else if (s->spaces) {
+            size_t chunk = s->spaces < cap - n ? s->spaces : cap - n;
+            memset(buf + n, ' ', chunk);
+            s->spaces -= chunk;
+            n += chunk;
+        } else if (s->str) {
+            n += ser_string_step(s, buf + n, cap - n);
+        } else if (!ser_step(s)) {
+            break;
+        }
+    }
+    return n;
+}
+
+bool json_serializer_done(const JsonSerializer *s) {
+    return s && !s->failed && !s->root && s->depth == 0 && !s->str &&
+           !s->spaces && s->pending_pos == s->pending_len;
+}
+
+/* --- Templates --- */
+
+typedef struct {
+    const char *name;        // points into the skeleton until compiling ends
+    size_t name_len;
+    JsonSlotType type;
+} TemplateSlot;
+
+/* Static text up to 'cut', then slot 'slot' rendered at nesting 'depth'. */
+typedef struct {
+    size_t cut;
+    int slot;
+    int depth;
+} TemplatePiece;
+
+struct JsonTemplate {
+    char *text;              // the static runs, already escaped and laid out
+    size_t text_len;
+    TemplatePiece *pieces;
+    int piece_count;
+    TemplateSlot *slots;
+    int slot_count;
+    bool pretty;
+};
+
+struct TemplateBuild {
+    JsonTemplate *t;
+    bool failed;             // clashing types or out of memory
+};
+
+static const struct {
+    const char *name;
+    JsonSlotType type;
+} kSlotTypes[] = {
+    { "string", JSON_SLOT_STRING },
+    { "number", JSON_SLOT_NUMBER },
+    { "bool",   JSON_SLOT_BOOL },
+    { "json",   JSON_SLOT_VALUE }
+};
+
+static bool is_slot_marker(const char *str, size_t len) {
+    return len >= 4 && memcmp(str, "{{", 2) == 0 && memcmp(str + len - 2, "}}", 2) == 0;
+}
+
+/* The JsonSlotType of a well-formed "{{name:type}}" marker, or -1. */
+static int slot_marker_type(const char *str, size_t len, size_t *name_len) {
+    if (!is_slot_marker(str, len)) return -1;
+    const char *name = str + 2;
+    const char *colon = memchr(name, ':', len - 4);
+    if (!colon || colon == name || *name == '=') return -1;
+    *name_len = (size_t)(colon - name);
+    size_t type_len = len - 4 - *name_len - 1;
+
+    for (size_t i = 0; i < sizeof(kSlotTypes) / sizeof(kSlotTypes[0]); i++) {
+        if (strlen(kSlotTypes[i].name) == type_len &&
+            memcmp(kSlotTypes[i].name, colon + 1, type_len) == 0) {
+            return (int)kSlotTypes[i].type;
+        }
+    }
+    return -1;
+}
+
+static int count_slot_markers(JsonValue *v) {
+    if (!v) return 0;
+    if (v->type == JSON_STRING) {
+        size_t name_len;
+        return slot_marker_type(v->as.string, strlen(v->as.string), &name_len) >= 0;
+    }
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return 0;
+
+    int n = 0;
+    for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+        n += count_slot_markers(curr->value);
+    }
+    return n;
+}
+
+/* Called by json_write_internal for every string while a template is being
+   compiled. A "{{name:type}}" marker ends the current static run and records
+   a slot. "{{=" is an escape that writes a literal "{{"; anything else,
+   including strings that merely look like markers, is written normally. */
+static bool template_slot(JsonOut *o, const char *str, int depth) {
+    size_t len = strlen(str);
+    if (is_slot_marker(str, len) && str[2] == '=') {
+        w_mem(o, "\"{{", 3);
+        w_escaped_run(o, str + 3, len - 3);
+        w_char(o, '"');
+        return true;
+    }
+    size_t name_len;
+    int type = slot_marker_type(str, len, &name_len);
+    if (type < 0) return false;
+
+    TemplateBuild *b = o->tpl;
+    JsonTemplate *t = b->t;
+    if (b->failed) return true;
+    const char *name = str + 2;
+
+    // The same name may appear more than once, always with the same type
+    int slot = 0;
+    while (slot < t->slot_count &&
+           !(t->slots[slot].name_len == name_len && memcmp(t->slots[slot].name, name, name_len) == 0)) {
+        slot++;
+    }
+    if (slot == t->slot_count) {
+        t->slots[slot].name = name;
+        t->slots[slot].name_len = name_len;
+        t->slots[slot].type = (JsonSlotType)type;
+        t->slot_count++;
+    } else if (t->slots[slot].type != (JsonSlotType)type) {
+        b->failed = true;
+        return true;
+    }
+
+    TemplatePiece *p = &t->pieces[t->piece_count++];
+    p->cut = o->len;
+    p->slot = slot;
+    p->depth = depth;
+    return true;
+}
+
+JsonTemplate *json_template_compile(Arena *a, JsonValue *skeleton, unsigned flags) {
+    // Slot values are formatted at render time, outside canonical mode
+    if (!a || !skeleton || (flags & JSON_WRITE_CANONICAL)) return NULL;
+    ArenaTemp mark = arena_temp_begin(a);
+
+    int markers = count_slot_markers(skeleton);
+    JsonTemplate *t = arena_alloc_zero(a, sizeof(JsonTemplate));
+    TemplatePiece *pieces = arena_alloc_array(a, TemplatePiece, markers + 1);
+    TemplateSlot *slots = arena_alloc_array(a, TemplateSlot, markers + 1);
+    if (!t || !pieces || !slots) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+    t->pieces = pieces;
+    t->slots = slots;
+    t->pretty = (flags & JSON_WRITE_PRETTY) != 0;
+
+    TemplateBuild b = { t, false };
+    JsonOut o = {0};
+    o.arena = a;
+    o.tpl = &b;
+    json_write_internal(skeleton, &o, 0, t->pretty);
+    if (b.failed || o.failed) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+
+    t->text = arena_realloc(a, o.buf, o.cap, o.len);
+    t->text_len = o.len;
+
+    // Names still point into the skeleton, which may not outlive the template
+    for (int i = 0; i < t->slot_count; i++) {
+        TemplateSlot *slot = &t->slots[i];
+        char *name = arena_alloc_array(a, char, slot->name_len + 1);
+        if (!name) {
+            arena_temp_rollback(mark);
+            return NULL;
+        }
+        memcpy(name, slot->name, slot->name_len);
+        name[slot->name_len] = '\0';
+        slot->name = name;
+    }
+    return t;
+}
+
+JsonTemplate *json_template_parse(Arena *a, const char *text, size_t len, unsigned flags, JsonError *err) {
+    if (!a) return NULL;
+
+    // The skeleton is only needed while compiling
+    Arena scratch = {0};
+    JsonValue *skeleton = json_parse(&scratch, text, len, err);
+    JsonTemplate *t = skeleton ? json_template_compile(a, skeleton, flags) : NULL;
+    arena_free(&scratch);
+    return t;
+}
+
+int json_template_slot_count(const JsonTemplate *t) {
+    return t ? t->slot_count : 0;
+}
+
+int json_template_slot(const JsonTemplate *t, const char *name) {
+    if (!t || !name) return -1;
+    for (int i = 0; i < t->slot_count; i++) {
+        if (strcmp(t->slots[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+JsonSlotType json_template_slot_type(const JsonTemplate *t, int slot) {
+    if (!t || slot < 0 || slot >= t->slot_count) return JSON_SLOT_INVALID;
+    return t->slots[slot].type;
+}
+
+/* Static runs are copied as-is; only slot values are formatted or escaped. */
+static void template_render(const JsonTemplate *t, const JsonSlotValue *values, JsonOut *o) {
+    size_t pos = 0;
+    for (int i = 0; i < t->piece_count; i++) {
+        const TemplatePiece *p = &t->pieces[i];
+        const JsonSlotValue *v = &values[p->slot];
+        if (p->cut > pos) w_mem(o, t->text + pos, p->cut - pos);
+        pos = p->cut;
+
+        switch (t->slots[p->slot].type) {
+            case JSON_SLOT_STRING:
+                if (v->string) w_escaped_string(o, v->string);
+                else w_mem(o, "null", 4);
+                break;
+            case JSON_SLOT_NUMBER:
+                if (!isfinite(v->number)) {
+                    w_mem(o, "null", 4);
+                } else {
+                    char num_buf[64];
+                    w_mem(o, num_buf, (size_t)fmt_double(num_buf, v->number));
+                }
+                break;
+            case JSON_SLOT_BOOL:
+                if (v->boolean) w_mem(o, "true", 4);
+                else w_mem(o, "false", 5);
+                break;
+            case JSON_SLOT_VALUE:
+                if (v->value) json_write_internal(v->value, o, p->depth, t->pretty);
+                else w_mem(o, "null", 4);
+                break;
+            case JSON_SLOT_INVALID:
+                break;
+        }
+    }
+    if (t->text_len > pos) w_mem(o, t->text + pos, t->text_len - pos);
+}
+
+char *json_template_render(Arena *a, const JsonTemplate *t, const JsonSlotValue *values, size_t *out_len) {
+    if (!a || !t || (t->slot_count && !values)) return NULL;
+
+    JsonOut o = {0};
+    o.arena = a;
+    out_reserve(&o, t->text_len + 64);
+    template_render(t, values, &o);
+    w_char(&o, '\0');
+    if (o.failed) return NULL;
+
+    char *result = arena_realloc(a, o.buf, o.cap, o.len);
+    if (out_len) *out_len = o.len - 1;
+    return result;
+}
+
+size_t json_template_render_buffer(const JsonTemplate *t, const JsonSlotValue *values, char *buf, size_t cap) {
+    if (!t || (t->slot_count && !values)) return 0;
+
+    JsonOut o = {0};
+    o.buf = buf;
+    o.cap = cap ? cap - 1 : 0;
+    template_render(t, values, &o);
+    if (cap) buf[o.len] = '\0';
+    return o.len + o.dropped;
+}
+
+/* --- Serialization Cache --- */
+
+/* Per-container bookkeeping, allocated on first need. Appends only need
+   'tail', so containers no cache or json_track has adopted get just the
+   fields before 'parent' (see list_set_tail). */
+struct JsonMeta {
+    JsonNode *tail;     // last node, for O(1) appends; NULL = unknown
+    bool tracked;       // the fields below exist and are kept up to date
+    JsonValue *parent;
+    JsonCache *owner;   // the cache 'size' and 'rel' refer to
+    size_t size;        // serialized size, current while 'valid'
+    // Where its bytes start in the previous output, relative to its parent's
+    // bytes, so it stays correct inside a subtree that was copied unchanged
+    size_t rel;
+    uint64_t hash;      // json_hash, current while 'hashed'
+    bool valid;         // nothing below changed since it was last written
+    bool placed;        // 'rel' locates it in the owner's previous output
+    bool hashed;
+};
+
+struct JsonCache {
+    JsonValue *root;
+    bool pretty;
+    Arena bufs[2];      // the last two outputs, alternately reused
+    int cur;            // index of the previous output in 'bufs'
+    char *prev;         // NULL before the first call
+};
+
+/* The meta of a tracked container, or NULL. */
+static JsonMeta *meta_of(JsonValue *v) {
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return NULL;
+    JsonMeta *m = v->as.list.meta;
+    return m && m->tracked ? m : NULL;
+}
+
+/* A full, tracked meta for 'v', keeping the tail of a short one. */
+static JsonMeta *meta_full(Arena *a, JsonValue *v) {
+    JsonMeta *m = v->as.list.meta;
+    if (m && m->tracked) return m;
+    JsonMeta *full = arena_alloc_zero(a, sizeof(JsonMeta));
+    if (!full) return NULL;
+    if (m) full->tail = m->tail;
+    full->tracked = true;
+    v->as.list.meta = full;
+    return full;
+}
+
+/* Gives every container of 'v' that lacks one a meta, and re-parents 'v'. */
+static void meta_attach(Arena *a, JsonValue *v, JsonValue *parent) {
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return;
+
+    bool fresh = meta_of(v) == NULL;
+    JsonMeta *m = meta_full(a, v);
+    if (!m) return;
+    m->parent = parent;
+    m->valid = false;
+    m->placed = false;
+    if (!fresh) return;
+
+    for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+        meta_attach(a, curr->value, v);
+    }
+}
+
+/* Gives every container in 'v' a fresh meta, also those seen by other caches. */
+static bool meta_reset(Arena *a, JsonValue *v, JsonValue *parent) {
+    if (v->type != JSON_ARRAY && v->type != JSON_OBJECT) return true;
+
+    JsonMeta *m = meta_full(a, v);
+    if (!m) return false;
+    JsonNode *tail = m->tail;
+    memset(m, 0, sizeof(JsonMeta));
+    m->tail = tail;
+    m->tracked = true;
+    m->parent = parent;
+
+    for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+        if (!meta_reset(a, curr->value, v)) return false;
+    }
+    return true;
+}
+
+/* Marks 'v' and its ancestors as changed, for edits that keep the tail. */
+static void meta_changed(JsonValue *v) {
+    // A stale container only ever has stale ancestors, so stop at the first
+    JsonMeta *m = meta_of(v);
+    while (m && (m->valid || m->hashed)) {
+        m->valid = false;
+        m->hashed = false;
+        m = m->parent ? meta_of(m->parent) : NULL;
+    }
+}
+
+void json_invalidate(JsonValue *v) {
+    if (!v) return;
+    // The nodes may have been relinked by hand; the next append finds the end
+    if ((v->type == JSON_ARRAY || v->type == JSON_OBJECT) && v->as.list.meta) {
+        v->as.list.meta->tail = NULL;
+    }
+    meta_changed(v);
+}
+
+/* Only a container's own parent may use its cached state; a value shared
+   with another container is written from scratch there. */
+static JsonMeta *meta_owned(JsonValue *v, JsonValue *parent) {
+    JsonMeta *m = meta_of(v);
+    return m && m->parent == parent ? m : NULL;
+}
+
+static size_t measure_plain(JsonCache *c, JsonValue *v, int depth) {
+    JsonOut o = {0};
+    json_write_internal(v, &o, depth, c->pretty);
+    return o.dropped;
+}
+
+static size_t cache_measure(JsonCache *c, JsonValue *v, JsonValue *parent, int depth) {
+    JsonMeta *m = meta_owned(v, parent);
+    if (!m) return measure_plain(c, v, depth);
+    if (m->owner == c && m->valid) return m->size;
+
+    size_t size = 2, n = 0;
+    for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+        if (v->type == JSON_OBJECT) {
+            JsonOut o = {0};
+            w_escaped_string(&o, curr->key);
+            size += o.dropped + (c->pretty ? 2 : 1);
+        }
+        size += cache_measure(c, curr->value, v, depth + 1);
+        n++;
+    }
+    if (n) {
+        size += n - 1;
+        if (c->pretty) size += (n + 1) + n * (size_t)(depth + 1) * 2 + (size_t)depth * 2;
+    }
+    m->size = size;
+    return size;
+}
+
+/* 'old' is where 'v' sits in the previous output, or NULL if unknown. */
+static void cache_write(JsonCache *c, JsonValue *v, JsonValue *parent, JsonOut *o,
+                        int depth, const char *old, size_t parent_start) {
+    JsonMeta *m = meta_owned(v, parent);
+    if (!m) {
+        json_write_internal(v, o, depth, c->pretty);
+        return;
+    }
+
+    size_t start = o->len;
+    if (old && m->owner == c && m->valid) {
+        w_mem(o, old, m->size);
+    } else {
+        bool pretty = c->pretty;
+        w_char(o, v->type == JSON_OBJECT ? '{' : '[');
+        if (v->as.list.head && pretty) w_char(o, '\n');
+        for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+            if (pretty) w_indent(o, (depth + 1) * 2);
+            if (v->type == JSON_OBJECT) {
+                w_escaped_string(o, curr->key);
+                if (pretty) w_mem(o, ": ", 2);
+                else w_char(o, ':');
+            }
+            JsonMeta *cm = meta_owned(curr->value, v);
+            const char *child_old = NULL;
+            if (old && cm && cm->owner == c && cm->placed) child_old = old + cm->rel;
+            cache_write(c, curr->value, v, o, depth + 1, child_old, start);
+
+            if (curr->next) {
+                w_char(o, ',');
+                if (pretty) w_char(o, '\n');
+            }
+        }
+        if (v->as.list.head && pretty) {
+            w_char(o, '\n');
+            w_indent(o, depth * 2);
+        }
+        w_char(o, v->type == JSON_OBJECT ? '}' : ']');
+    }
+
+    m->owner = c;
+    m->size = o->len - start;
+    m->rel = start - parent_start;
+    m->valid = true;
+    m->placed = true;
+}
+
+JsonCache *json_cache_new(Arena *a, JsonValue *root, unsigned flags) {
+    // Cached bytes are copied as they are, so keys are never re-sorted
+    if (!a || !root || (flags & JSON_WRITE_CANONICAL)) return NULL;
+    JsonCache *c = arena_alloc_zero(a, sizeof(JsonCache));
+    if (!c) return NULL;
+    c->root = root;
+    c->pretty = (flags & JSON_WRITE_PRETTY) != 0;
+
+    if (!meta_reset(a, root, NULL)) return NULL;
+    return c;
+}
+
+const char *json_cache_to_string(JsonCache *c, size_t *out_len) {
+    if (!c) return NULL;
+
+    size_t total = cache_measure(c, c->root, NULL, 0);
+
+    int next = c->cur ^ 1;
+    arena_reset(&c->bufs[next]);
+    JsonOut o = {0};
+    o.buf = arena_alloc_array(&c->bufs[next], char, total + 1);
+    o.cap = total;
+    if (!o.buf) return NULL;
+
+    JsonMeta *m = meta_owned(c->root, NULL);
+    const char *old = c->prev && m && m->owner == c && m->placed ? c->prev : NULL;
+    cache_write(c, c->root, NULL, &o, 0, old, 0);
+    o.buf[o.len] = '\0';
+
+    c->prev = o.buf;
+    c->cur = next;
+    if (out_len) *out_len = o.len;
+    return o.buf;
+}
+
+void json_cache_free(JsonCache *c) {
+    if (!c) return;
+    arena_free(&c->bufs[0]);
+    arena_free(&c->bufs[1]);
+    c->prev = NULL;
+}
+
+/* --- Builder Implementation --- */
+
+JsonValue *json_create_null(Arena *a) { 
+    if (!a) return NULL; 
+    return make_value(a, JSON_NULL); 
+}
+JsonValue *json_create_bool(Arena *a, bool b) { 
+    if (!a) return NULL;
+    JsonValue *v = make_value(a, JSON_BOOL); 
+    if (v) v->as.boolean = b; 
+    return v;
+}
+JsonValue *json_create_number(Arena *a, double num) {
+    if (!a) return NULL;
+    JsonValue *v = make_value(a, JSON_NUMBER); 
+    if (v) v->as.number = num; 
+    return v;
+}
+JsonValue *json_create_string(Arena *a, const char *str) {
+    if (!a || !str) return NULL;
+    ArenaTemp mark = arena_temp_begin(a);
+    JsonValue *v = make_value(a, JSON_STRING);
+    if (!v) return NULL;
+    size_t len = strlen(str);
+    v->as.string = arena_alloc_array(a, char, len + 1);
+    if (!v->as.string) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+    memcpy(v->as.string, str, len + 1);
+    return v;
+}
+JsonValue *json_create_string_ref(Arena *a, const char *str, size_t len) {
+    if (!a || !str || str[len] != '\0') return NULL;
+    JsonValue *v = make_value(a, JSON_STRING);
+    if (v) v->as.string = (char *)str;
+    return v;
+}
+JsonValue *json_create_raw(Arena *a, const char *json, size_t len) {
+    if (!a || !json || !raw_span(&json, &len)) return NULL;
+    ArenaTemp mark = arena_temp_begin(a);
+    JsonValue *v = make_value(a, JSON_RAW);
+    if (!v) return NULL;
+    v->as.raw.ptr = arena_alloc_array(a, char, len + 1);
+    if (!v->as.raw.ptr) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+    memcpy(v->as.raw.ptr, json, len);
+    v->as.raw.ptr[len] = '\0';
+    v->as.raw.len = len;
+    return v;
+}
+JsonValue *json_create_raw_ref(Arena *a, const char *json, size_t len) {
+    if (!a || !json || !len) return NULL;
+    JsonValue *v = make_value(a, JSON_RAW);
+    if (v) {
+        v->as.raw.ptr = (char *)json;
+        v->as.raw.len = len;
+    }
+    return v;
+}
+JsonValue *json_create_array(Arena *a) { 
+    if (!a) return NULL;
+    return make_value(a, JSON_ARRAY); 
+}
+JsonValue *json_create_object(Arena *a) { 
+    if (!a) return NULL;
+    return make_value(a, JSON_OBJECT); 
+}
+
+/* One arena block for a whole array: the array, its 'n' nodes, their 'n'
+   values and 'extra' bytes of text, with the nodes linked in order. The
+   caller fills in the values, which start out as nulls. */
+static JsonValue *bulk_array(Arena *a, size_t n, size_t extra, char **text) {
+    size_t per = sizeof(JsonNode) + sizeof(JsonValue);
+    if (n > (SIZE_MAX - sizeof(JsonValue) - extra) / per) return NULL;
+
+    char *block = arena_alloc(a, sizeof(JsonValue) + n * per + extra);
+    if (!block) return NULL;
+    JsonValue *arr = (JsonValue *)block;
+    JsonNode *nodes = (JsonNode *)(arr + 1);
+    JsonValue *vals = (JsonValue *)(nodes + n);
+    if (text) *text = (char *)(vals + n);
+
+    memset(arr, 0, sizeof(JsonValue));
+    arr->type = JSON_ARRAY;
+    for (size_t i = 0; i < n; i++) {
+        memset(&vals[i], 0, sizeof(JsonValue));
+        vals[i].type = JSON_NULL;
+        nodes[i].key = NULL;
+        nodes[i].value = &vals[i];
+        nodes[i].next = i + 1 < n ? &nodes[i + 1] : NULL;
+    }
+    if (n) arr->as.list.head = nodes;
+    return arr;
+}
+
+JsonValue *json_create_number_array(Arena *a, const double *nums, size_t n) {
+    if (!a || (n && !nums)) return NULL;
+    JsonValue *arr = bulk_array(a, n, 0, NULL);
+    if (!arr) return NULL;
+    size_t i = 0;
+    for (JsonNode *node = arr->as.list.head; node; node = node->next, i++) {
+        node->value->type = JSON_NUMBER;
+        node->value->as.number = nums[i];
+    }
+    return arr;
+}
+
+JsonValue *json_create_int64_array(Arena *a, const int64_t *nums, size_t n) {
+    if (!a || (n && !nums)) return NULL;
+    JsonValue *arr = bulk_array(a, n, 0, NULL);
+    if (!arr) return NULL;
+    size_t i = 0;
+    for (JsonNode *node = arr->as.list.head; node; node = node->next, i++) {
+        node->value->type = JSON_NUMBER;
+        node->value->as.number = (double)nums[i];
+    }
+    return arr;
+}
+
+JsonValue *json_create_string_array(Arena *a, const char *const *strs, size_t n) {
+    if (!a || (n && !strs)) return NULL;
+    size_t text = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strs[i]) text += strlen(strs[i]) + 1;
+    }
+
+    char *p;
+    JsonValue *arr = bulk_array(a, n, text, &p);
+    if (!arr) return NULL;
+    size_t i = 0;
+    for (JsonNode *node = arr->as.list.head; node; node = node->next, i++) {
+        if (!strs[i]) continue; // stays null
+        size_t len = strlen(strs[i]);
+        memcpy(p, strs[i], len + 1);
+        node->value->type = JSON_STRING;
+        node->value->as.string = p;
+        p += len + 1;
+    }
+    return arr;
+}
+
+/* The last node of a container, in O(1) once a tail is recorded. Lists
+   without one (parsed, bulk-built, cloned) or linked by hand through 'head'
+   are walked from the last known node. */
+static JsonNode *list_last(JsonValue *v) {
+    if (!v->as.list.head) return NULL;
+    JsonMeta *m = v->as.list.meta;
+    JsonNode *last = m && m->tail ? m->tail : v->as.list.head;
+    while (last->next) last = last->next;
+    return last;
+}
+
+/* Records 'node' as the last node. With an arena, a container without a meta
+   gets the short form holding just the tail, so JsonValue stays 24 bytes and
+   only containers that are appended to pay for it. */
+static void list_set_tail(Arena *a, JsonValue *v, JsonNode *node) {
+    JsonMeta *m = v->as.list.meta;
+    if (!m && a && node) {
+        m = arena_alloc_zero(a, offsetof(JsonMeta, parent));
+        v->as.list.meta = m;
+    }
+    if (m) m->tail = node;
+}
+
+/* Links 'node' (its 'next' already NULL) after the last child of 'parent'. */
+static void list_link(Arena *a, JsonValue *parent, JsonNode *node) {
+    JsonNode *last = list_last(parent);
+    if (last) last->next = node;
+    else parent->as.list.head = node;
+    list_set_tail(a, parent, node);
+
+    if (meta_of(parent)) {
+        meta_attach(a, node->value, parent);
+        meta_changed(parent);
+    }
+}
+
+static void json_list_append(Arena *a, JsonValue *parent, const char *key, JsonValue *val) {
+    if (!a || !parent || !val) return; 
+
+    ArenaTemp mark = arena_temp_begin(a);
+    JsonNode *node = arena_alloc_struct(a, JsonNode);
+    if (!node) return; 
+
+    if (key) {
+        size_t len = strlen(key);
+        node->key = arena_alloc_array(a, char, len + 1);
+        if (!node->key) {
+            // Never link a member without a key
+            arena_temp_rollback(mark);
+            return;
+        }
+        memcpy(node->key, key, len + 1);
+    } else {
+        node->key = NULL;
+    }
+    node->value = val;
+    node->next = NULL;
+    list_link(a, parent, node);
+}
+
+JsonSavepoint json_savepoint(Arena *a, JsonValue *container) {
+    JsonSavepoint sp;
+    sp.mark = arena_temp_begin(a);
+    sp.container = container;
+    sp.meta = NULL;
+    sp.last = NULL;
+    if (container && (container->type == JSON_ARRAY || container->type == JSON_OBJECT)) {
+        sp.meta = container->as.list.meta;
+        sp.last = list_last(container);
+    }
+    return sp;
+}
+
+void json_rollback(JsonSavepoint sp) {
+    if (sp.container && (sp.container->type == JSON_ARRAY || sp.container->type == JSON_OBJECT)) {
+        if (sp.last) sp.last->next = NULL;
+        else sp.container->as.list.head = NULL;
+        // A meta allocated since the savepoint is about to be freed
+        sp.container->as.list.meta = sp.meta;
+        list_set_tail(NULL, sp.container, sp.last);
+        meta_changed(sp.container);
+    }
+    arena_temp_rollback(sp.mark);
+}
+
+void json_add(Arena *a, JsonValue *obj, const char *key, JsonValue *val) {
+    if (!obj || !key || !val) return;
+    if (obj->type == JSON_OBJECT) json_list_append(a, obj, key, val);
+}
+void json_add_static(Arena *a, JsonValue *obj, const char *key, size_t key_len, JsonValue *val) {
+    if (!a || !obj || !key || !val || obj->type != JSON_OBJECT) return;
+    if (key[key_len] != '\0') return;
+
+    JsonNode *node = arena_alloc_struct(a, JsonNode);
+    if (!node) return;
+    node->key = (char *)key;
+    node->value = val;
+    node->next = NULL;
+    list_link(a, obj, node);
+}
+void json_add_string(Arena *a, JsonValue *obj, const char *key, const char *val) {
+    if (!val) return;
+    json_add(a, obj, key, json_create_string(a, val));
+}
+void json_add_number(Arena *a, JsonValue *obj, const char *key, double val) {
+    json_add(a, obj, key, json_create_number(a, val));
+}
+void json_add_bool(Arena *a, JsonValue *obj, const char *key, bool val) {
+    json_add(a, obj, key, json_create_bool(a, val));
+}
+void json_add_null(Arena *a, JsonValue *obj, const char *key) {
+    json_add(a, obj, key, json_create_null(a));
+}
+
+void json_add_fields(Arena *a, JsonValue *obj, const JsonField *fields, size_t n) {
+    if (!a || !obj || obj->type != JSON_OBJECT || (n && !fields)) return;
+
+    // Entries json_add would ignore are skipped
+    size_t count = 0, text = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!fields[i].key || !fields[i].value) continue;
+        count++;
+        text += strlen(fields[i].key) + 1;
+    }
+    if (!count || count > (SIZE_MAX - text) / sizeof(JsonNode)) return;
+
+    JsonNode *nodes = arena_alloc(a, count * sizeof(JsonNode) + text);
+    if (!nodes) return;
+    char *p = (char *)(nodes + count);
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!fields[i].key || !fields[i].value) continue;
+        size_t len = strlen(fields[i].key);
+        memcpy(p, fields[i].key, len + 1);
+        nodes[k].key = p;
+        nodes[k].value = fields[i].value;
+        nodes[k].next = k + 1 < count ? &nodes[k + 1] : NULL;
+        p += len + 1;
+        k++;
+    }
+
+    JsonNode *last = list_last(obj);
+    if (last) last->next = nodes;
+    else obj->as.list.head = nodes;
+    list_set_tail(a, obj, &nodes[count - 1]);
+
+    if (meta_of(obj)) {
+        for (size_t i = 0; i < count; i++) meta_attach(a, nodes[i].value, obj);
+        meta_changed(obj);
+    }
+}
+
+void json_append(Arena *a, JsonValue *arr, JsonValue *val) {
+    if (!arr || !val) return;
+    if (arr->type == JSON_ARRAY) json_list_append(a, arr, NULL, val);
+}
+void json_append_string(Arena *a, JsonValue *arr, const char *val) {
+    if (!val) return;
+    json_append(a, arr, json_create_string(a, val));
+}
+void json_append_number(Arena *a, JsonValue *arr, double val) {
+    json_append(a, arr, json_create_number(a, val));
 }
 void json_append_bool(Arena *a, JsonValue *arr, bool val) {
     json_append(a, arr, json_create_bool(a, val));
 }
-void json_append_null(Arena *a, JsonValue *arr) {
-    json_append(a, arr, json_create_null(a));
+void json_append_null(Arena *a, JsonValue *arr) {
+    json_append(a, arr, json_create_null(a));
+}
+
+/* --- Deep Clone --- */
+
+/* Bytes for the value and node structs of a subtree, and for its text. */
+static void clone_measure(const JsonValue *v, size_t *structs, size_t *text) {
+    if (!v) return;
+    *structs += sizeof(JsonValue);
+    switch (v->type) {
+        case JSON_STRING:
+            *text += strlen(v->as.string) + 1;
+            break;
+        case JSON_RAW:
+            *text += v->as.raw.len + 1;
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            // Array nodes from the parser leave 'key' unset
+            for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+                *structs += sizeof(JsonNode);
+                if (v->type == JSON_OBJECT) *text += strlen(curr->key) + 1;
+                clone_measure(curr->value, structs, text);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+typedef struct {
+    char *structs; // next value or node, in depth-first order
+    char *text;    // next string byte, after all the structs
+} CloneCursor;
+
+static char *clone_text(CloneCursor *c, const char *s, size_t len) {
+    char *dst = c->text;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    c->text += len + 1;
+    return dst;
+}
+
+static JsonValue *clone_copy(const JsonValue *src, CloneCursor *c) {
+    if (!src) return NULL;
+    JsonValue *v = (JsonValue *)c->structs;
+    c->structs += sizeof(JsonValue);
+    memset(v, 0, sizeof(JsonValue));
+    v->type = src->type;
+
+    switch (src->type) {
+        case JSON_NULL:
+            break;
+        case JSON_BOOL:
+            v->as.boolean = src->as.boolean;
+            break;
+        case JSON_NUMBER:
+            v->as.number = src->as.number;
+            break;
+        case JSON_STRING:
+            v->as.string = clone_text(c, src->as.string, strlen(src->as.string));
+            break;
+        case JSON_RAW:
+            v->as.raw.ptr = clone_text(c, src->as.raw.ptr, src->as.raw.len);
+            v->as.raw.len = src->as.raw.len;
+            break;
+        case JSON_ARRAY:
+        case JSON_OBJECT: {
+            JsonNode **link = &v->as.list.head;
+            for (JsonNode *curr = src->as.list.head; curr; curr = curr->next) {
+                JsonNode *node = (JsonNode *)c->structs;
+                c->structs += sizeof(JsonNode);
+                node->key = src->type == JSON_OBJECT ? clone_text(c, curr->key, strlen(curr->key)) : NULL;
+                node->next = NULL;
+                *link = node;
+                link = &node->next;
+                node->value = clone_copy(curr->value, c);
+            }
+            break;
+        }
+    }
+    return v;
+}
+
+JsonValue *json_clone(Arena *dst, const JsonValue *src) {
+    if (!dst || !src) return NULL;
+
+    size_t structs = 0, text = 0;
+    clone_measure(src, &structs, &text);
+
+    char *block = arena_alloc(dst, structs + text);
+    if (!block) return NULL;
+    CloneCursor c = { block, block + structs };
+    return clone_copy(src, &c);
+}
+
+/* --- Deduplication --- */
+
+typedef struct {
+    uint64_t hash;
+    JsonValue *value; // NULL = empty slot
+} DedupSlot;
+
+typedef struct {
+    Arena *dst;
+    Arena tables;     // slot arrays; outgrown ones are simply left behind
+    Arena stack;      // child lists of the containers being built
+    DedupSlot *slots;
+    size_t mask;
+    size_t count;
+} Dedup;
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t hash_final(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+/* 16 bytes per step in two independent multiply-rotate lanes, so long
+   strings hash at memory speed. The result depends on byte order, which is
+   fine for in-process tables. */
+static uint64_t hash_bytes(const char *s, size_t len) {
+    const uint64_t k1 = 0x9e3779b97f4a7c15ULL, k2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t h1 = (uint64_t)len * k1, h2 = ~(uint64_t)len * k2;
+    for (; len >= 16; s += 16, len -= 16) {
+        uint64_t a, b;
+        memcpy(&a, s, 8);
+        memcpy(&b, s + 8, 8);
+        h1 = ROTL64(h1 ^ (a * k2), 31) * k1;
+        h2 = ROTL64(h2 ^ (b * k1), 29) * k2;
+    }
+    uint64_t tail[2] = {0, 0};
+    memcpy(tail, s, len);
+    h1 = ROTL64(h1 ^ (tail[0] * k2), 31) * k1;
+    h2 = ROTL64(h2 ^ (tail[1] * k1), 29) * k2;
+    return hash_final(h1 ^ ROTL64(h2, 17));
+}
+
+static uint64_t hash_mix(uint64_t h, uint64_t x) {
+    return h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+/* Scalars compare by content; -0 and 0 stay apart so the output is unchanged. */
+static bool dedup_same_scalar(const JsonValue *a, const JsonValue *b) {
+    if (a->type != b->type) return false;
+    switch (a->type) {
+        case JSON_NULL:   return true;
+        case JSON_BOOL:   return a->as.boolean == b->as.boolean;
+        case JSON_NUMBER: return memcmp(&a->as.number, &b->as.number, sizeof(double)) == 0;
+        case JSON_STRING: return strcmp(a->as.string, b->as.string) == 0;
+        case JSON_RAW:
+            return a->as.raw.len == b->as.raw.len &&
+                   memcmp(a->as.raw.ptr, b->as.raw.ptr, a->as.raw.len) == 0;
+        default:          return false;
+    }
+}
+
+/* Children are canonical already, so containers compare by pointer. */
+static bool dedup_same_list(const JsonValue *cand, JsonType type, size_t n,
+                            char **keys, JsonValue **vals) {
+    if (cand->type != type) return false;
+    size_t i = 0;
+    for (JsonNode *curr = cand->as.list.head; curr; curr = curr->next, i++) {
+        if (i == n || curr->value != vals[i]) return false;
+        if (keys && curr->key != keys[i]) return false;
+    }
+    return i == n;
+}
+
+static bool dedup_grow(Dedup *d) {
+    size_t cap = d->slots ? (d->mask + 1) * 2 : 1024;
+    DedupSlot *slots = arena_alloc_array(&d->tables, DedupSlot, cap);
+    if (!slots) return false;
+    memset(slots, 0, cap * sizeof(DedupSlot));
+
+    for (size_t i = 0; d->slots && i <= d->mask; i++) {
+        if (!d->slots[i].value) continue;
+        size_t j = (size_t)d->slots[i].hash & (cap - 1);
+        while (slots[j].value) j = (j + 1) & (cap - 1);
+        slots[j] = d->slots[i];
+    }
+    d->slots = slots;
+    d->mask = cap - 1;
+    return true;
+}
+
+static void dedup_insert(Dedup *d, size_t slot, uint64_t hash, JsonValue *v) {
+    d->slots[slot].hash = hash;
+    d->slots[slot].value = v;
+    d->count++;
+}
+
+static JsonValue *dedup_build(Dedup *d, const JsonValue *src, uint64_t *out_hash);
+
+/* Keys share text with each other and with equal string values. */
+static char *dedup_key(Dedup *d, const char *key, uint64_t *hash) {
+    JsonValue probe;
+    probe.type = JSON_STRING;
+    probe.as.string = (char *)key;
+    JsonValue *v = dedup_build(d, &probe, hash);
+    return v ? v->as.string : NULL;
+}
+
+/* Returns the canonical copy of 'src' in d->dst, building its children
+   first. A slot is reserved before a new value is allocated. */
+static JsonValue *dedup_build(Dedup *d, const JsonValue *src, uint64_t *out_hash) {
+    if ((d->count + 1) * 2 > d->mask + 1 && !dedup_grow(d)) return NULL;
+
+    uint64_t h = hash_mix(0, (uint64_t)src->type);
+    if (src->type != JSON_ARRAY && src->type != JSON_OBJECT) {
+        switch (src->type) {
+            case JSON_BOOL:   h = hash_mix(h, src->as.boolean); break;
+            case JSON_NUMBER: h = hash_mix(h, hash_bytes((const char *)&src->as.number, sizeof(double))); break;
+            case JSON_STRING: h = hash_mix(h, hash_bytes(src->as.string, strlen(src->as.string))); break;
+            case JSON_RAW:    h = hash_mix(h, hash_bytes(src->as.raw.ptr, src->as.raw.len)); break;
+            default:          break;
+        }
+        *out_hash = h;
+
+        size_t i = (size_t)h & d->mask;
+        for (; d->slots[i].value; i = (i + 1) & d->mask) {
+            if (d->slots[i].hash == h && dedup_same_scalar(d->slots[i].value, src)) return d->slots[i].value;
+        }
+
+        JsonValue *v = NULL;
+        if (src->type == JSON_STRING) {
+            size_t len = strlen(src->as.string);
+            v = arena_alloc(d->dst, sizeof(JsonValue) + len + 1);
+            if (!v) return NULL;
+            *v = *src;
+            v->as.string = memcpy(v + 1, src->as.string, len + 1);
+        } else if (src->type == JSON_RAW) {
+            v = arena_alloc(d->dst, sizeof(JsonValue) + src->as.raw.len + 1);
+            if (!v) return NULL;
+            *v = *src;
+            v->as.raw.ptr = (char *)(v + 1);
+            memcpy(v->as.raw.ptr, src->as.raw.ptr, src->as.raw.len);
+            v->as.raw.ptr[src->as.raw.len] = '\0';
+        } else {
+            v = arena_alloc_struct(d->dst, JsonValue);
+            if (!v) return NULL;
+            *v = *src;
+        }
+        dedup_insert(d, i, h, v);
+        return v;
+    }
+
+    size_t n = 0;
+    for (JsonNode *curr = src->as.list.head; curr; curr = curr->next) n++;
+
+    ArenaTemp frame = arena_temp_begin(&d->stack);
+    bool object = src->type == JSON_OBJECT;
+    JsonValue **vals = n ? arena_alloc_array(&d->stack, JsonValue *, n) : NULL;
+    char **keys = n && object ? arena_alloc_array(&d->stack, char *, n) : NULL;
+    JsonValue *v = NULL;
+    if (n && (!vals || (object && !keys))) goto done;
+
+    size_t k = 0;
+    for (JsonNode *curr = src->as.list.head; curr; curr = curr->next, k++) {
+        uint64_t ch;
+        if (object) {
+            if (!(keys[k] = dedup_key(d, curr->key, &ch))) goto done;
+            h = hash_mix(h, ch);
+        }
+        if (!(vals[k] = dedup_build(d, curr->value, &ch))) goto done;
+        h = hash_mix(h, ch);
+    }
+    *out_hash = h;
+
+    // The table may have grown while the children were built
+    if ((d->count + 1) * 2 > d->mask + 1 && !dedup_grow(d)) goto done;
+    size_t i = (size_t)h & d->mask;
+    for (; d->slots[i].value; i = (i + 1) & d->mask) {
+        if (d->slots[i].hash == h && dedup_same_list(d->slots[i].value, src->type, n, keys, vals)) {
+            v = d->slots[i].value;
+            goto done;
+        }
+    }
+
+    v = arena_alloc(d->dst, sizeof(JsonValue) + n * sizeof(JsonNode));
+    if (!v) goto done;
+    memset(v, 0, sizeof(JsonValue));
+    v->type = src->type;
+    JsonNode *nodes = (JsonNode *)(v + 1);
+    for (k = 0; k < n; k++) {
+        nodes[k].key = keys ? keys[k] : NULL;
+        nodes[k].value = vals[k];
+        nodes[k].next = k + 1 < n ? &nodes[k + 1] : NULL;
+    }
+    if (n) v->as.list.head = nodes;
+    dedup_insert(d, i, h, v);
+
+done:
+    arena_temp_end(frame);
+    return v;
+}
+
+JsonValue *json_dedup(Arena *dst, const JsonValue *src) {
+    if (!dst || !src) return NULL;
+
+    Dedup d = {0};
+    d.dst = dst;
+    ArenaTemp mark = arena_temp_begin(dst);
+    uint64_t hash;
+    JsonValue *root = dedup_grow(&d) ? dedup_build(&d, src, &hash) : NULL;
+    if (!root) arena_temp_rollback(mark);
+
+    arena_free(&d.tables);
+    arena_free(&d.stack);
+    return root;
+}
+
+/* --- Hashing & Equality --- */
+
+void json_track(Arena *a, JsonValue *root) {
+    if (!a || !root) return;
+    JsonMeta *m = meta_of(root);
+    meta_attach(a, root, m ? m->parent : NULL);
+}
+
+static uint64_t value_hash(JsonValue *v) {
+    if (!v) return 0;
+    JsonMeta *m = meta_of(v);
+    if (m && m->hashed) return m->hash;
+
+    uint64_t h = hash_mix(0, (uint64_t)v->type);
+    switch (v->type) {
+        case JSON_NULL:
+            break;
+        case JSON_BOOL:
+            h = hash_mix(h, v->as.boolean);
+            break;
+        case JSON_NUMBER: {
+            double d = v->as.number == 0 ? 0.0 : v->as.number; // -0 == 0
+            h = hash_mix(h, hash_bytes((const char *)&d, sizeof(d)));
+            break;
+        }
+        case JSON_STRING:
+            h = hash_mix(h, hash_bytes(v->as.string, strlen(v->as.string)));
+            break;
+        case JSON_RAW:
+            h = hash_mix(h, hash_bytes(v->as.raw.ptr, v->as.raw.len));
+            break;
+        case JSON_ARRAY:
+            for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+                h = hash_mix(h, value_hash(curr->value));
+            }
+            break;
+        case JSON_OBJECT: {
+            // A sum of well-mixed member hashes does not depend on their order
+            uint64_t sum = 0;
+            for (JsonNode *curr = v->as.list.head; curr; curr = curr->next) {
+                uint64_t kh = hash_bytes(curr->key, strlen(curr->key));
+                sum += hash_final(hash_mix(kh, value_hash(curr->value)));
+            }
+            h = hash_mix(h, sum);
+            break;
+        }
+    }
+
+    if (m) {
+        m->hash = h;
+        m->hashed = true;
+    }
+    return h;
+}
+
+uint64_t json_hash(JsonValue *v) {
+    return value_hash(v);
+}
+
+static bool value_equal(JsonValue *a, JsonValue *b, Arena *scratch);
+
+/* Members in the same order are matched in one pass; from the first key
+   that differs, the rest of both lists are sorted by key and merged. */
+static bool object_equal(JsonValue *a, JsonValue *b, Arena *scratch) {
+    JsonNode *x = a->as.list.head, *y = b->as.list.head;
+    while (x && y && strcmp(x->key, y->key) == 0) {
+        if (!value_equal(x->value, y->value, scratch)) return false;
+        x = x->next;
+        y = y->next;
+    }
+    if (!x || !y) return !x && !y;
+
+    size_t n = 0, m = 0;
+    for (JsonNode *curr = x; curr; curr = curr->next) n++;
+    for (JsonNode *curr = y; curr; curr = curr->next) m++;
+    if (n != m) return false;
+
+    ArenaTemp temp = arena_temp_begin(scratch);
+    JsonNode **xs = arena_alloc_array(scratch, JsonNode *, 2 * n + n / 2);
+    bool equal = xs != NULL;
+    if (equal) {
+        JsonNode **ys = xs + n, **tmp = ys + n;
+        for (size_t i = 0; x; x = x->next, y = y->next, i++) {
+            xs[i] = x;
+            ys[i] = y;
+        }
+        sort_members(xs, tmp, n);
+        sort_members(ys, tmp, n);
+        for (size_t i = 0; equal && i < n; i++) {
+            equal = strcmp(xs[i]->key, ys[i]->key) == 0 &&
+                    value_equal(xs[i]->value, ys[i]->value, scratch);
+        }
+    }
+    arena_temp_end(temp);
+    return equal;
+}
+
+static bool value_equal(JsonValue *a, JsonValue *b, Arena *scratch) {
+    if (a == b) return true;
+    if (!a || !b || a->type != b->type) return false;
+
+    JsonMeta *ma = meta_of(a), *mb = meta_of(b);
+    if (ma && mb && ma->hashed && mb->hashed && ma->hash != mb->hash) return false;
+
+    switch (a->type) {
+        case JSON_NULL:   return true;
+        case JSON_BOOL:   return a->as.boolean == b->as.boolean;
+        case JSON_NUMBER: return a->as.number == b->as.number;
+        case JSON_STRING: return strcmp(a->as.string, b->as.string) == 0;
+        case JSON_RAW:
+            return a->as.raw.len == b->as.raw.len &&
+                   memcmp(a->as.raw.ptr, b->as.raw.ptr, a->as.raw.len) == 0;
+        case JSON_ARRAY: {
+            JsonNode *x = a->as.list.head, *y = b->as.list.head;
+            for (; x && y; x = x->next, y = y->next) {
+                if (!value_equal(x->value, y->value, scratch)) return false;
+            }
+            return !x && !y;
+        }
+        case JSON_OBJECT:
+            return object_equal(a, b, scratch);
+    }
+    return false;
+}
+
+bool json_equal(JsonValue *a, JsonValue *b) {
+    Arena scratch = {0};
+    bool equal = value_equal(a, b, &scratch);
+    arena_free(&scratch);
+    return equal;
+}
+
+/* --- Patching --- */
+
+#define PATCH_INDEX_MIN 16 // members before an object is worth indexing
+
+/* Open-addressing index of an object's members by key. Each slot holds the
+   link that points to the member (the object's 'head' or the previous
+   node's 'next'), so a member can be unlinked in O(1) without moving any
+   node. The first of duplicate keys wins, as in json_get. */
+typedef struct {
+    JsonNode ***slots;
+    size_t mask;
+    size_t live;
+    size_t used;   // live entries plus tombstones
+} MemberIndex;
+
+static JsonNode *kTombstone; // its address marks a deleted slot
+
+/* Lives in the patcher's scratch arena until the call ends, so a MemberIndex
+   pointer stays valid while other objects are looked up. */
+typedef struct {
+    JsonValue *obj;
+    MemberIndex ix;  // slots stay NULL until the second lookup
+    int lookups;
+} IndexedObject;
+
+typedef struct {
+    Arena *a;        // where new nodes and copied values go
+    Arena scratch;   // member indexes and their directory, alive for the whole call
+    Arena tokens;    // unescaped pointer tokens, reset per operation
+    IndexedObject **seen; // objects looked up so far, by address
+    size_t seen_mask;
+    size_t seen_count;
+} Patcher;
+
+/* The node whose 'next' is 'link', or NULL for the head of 'v'. */
+static JsonNode *link_owner(JsonValue *v, JsonNode **link) {
+    if (link == &v->as.list.head) return NULL;
+    return (JsonNode *)((char *)link - offsetof(JsonNode, next));
+}
+
+/* The slot holding 'key', or the free slot it would take. */
+static JsonNode ***index_slot(MemberIndex *ix, const char *key) {
+    JsonNode ***free_slot = NULL;
+    size_t i = (size_t)hash_bytes(key, strlen(key)) & ix->mask;
+    for (;; i = (i + 1) & ix->mask) {
+        JsonNode **link = ix->slots[i];
+        if (!link) return free_slot ? free_slot : &ix->slots[i];
+        if (link == &kTombstone) {
+            if (!free_slot) free_slot = &ix->slots[i];
+        } else if (strcmp((*link)->key, key) == 0) {
+            return &ix->slots[i];
+        }
+    }
+}
+
+static bool index_put(MemberIndex *ix, JsonNode **link) {
+    JsonNode ***slot = index_slot(ix, (*link)->key);
+    if (*slot && *slot != &kTombstone) return false; // an earlier duplicate
+    if (!*slot) ix->used++;
+    *slot = link;
+    ix->live++;
+    return true;
+}
+
+/* Rebuilds 'ix' from the members of 'obj', dropping tombstones. Objects
+   with fewer than 'min' members are left unindexed. */
+static bool index_build(Patcher *p, MemberIndex *ix, JsonValue *obj, size_t min) {
+    size_t n = 0;
+    for (JsonNode *curr = obj->as.list.head; curr; curr = curr->next) n++;
+    if (n < min) return false;
+
+    size_t cap = 16;
+    while (cap < n * 4) cap *= 2;
+    JsonNode ***slots = arena_alloc_array(&p->scratch, JsonNode **, cap);
+    if (!slots) return false;
+    memset(slots, 0, cap * sizeof(JsonNode **));
+
+    ix->slots = slots;
+    ix->mask = cap - 1;
+    ix->live = ix->used = 0;
+    for (JsonNode **link = &obj->as.list.head; *link; link = &(*link)->next) index_put(ix, link);
+    return true;
+}
+
+static bool seen_grow(Patcher *p) {
+    size_t cap = p->seen ? (p->seen_mask + 1) * 2 : 64;
+    IndexedObject **seen = arena_alloc_array(&p->scratch, IndexedObject *, cap);
+    if (!seen) return false;
+    memset(seen, 0, cap * sizeof(IndexedObject *));
+    for (size_t i = 0; p->seen && i <= p->seen_mask; i++) {
+        IndexedObject *e = p->seen[i];
+        if (!e) continue;
+        size_t j = (size_t)hash_final((uint64_t)(uintptr_t)e->obj) & (cap - 1);
+        while (seen[j]) j = (j + 1) & (cap - 1);
+        seen[j] = e;
+    }
+    p->seen = seen;
+    p->seen_mask = cap - 1;
+    return true;
+}
+
+/* The directory entry of 'obj', created on first use; NULL without memory. */
+static IndexedObject *patch_entry(Patcher *p, JsonValue *obj) {
+    if ((p->seen_count + 1) * 2 > (p->seen ? p->seen_mask + 1 : 0) && !seen_grow(p)) return NULL;
+    size_t i = (size_t)hash_final((uint64_t)(uintptr_t)obj) & p->seen_mask;
+    for (; p->seen[i]; i = (i + 1) & p->seen_mask) {
+        if (p->seen[i]->obj == obj) return p->seen[i];
+    }
+    IndexedObject *e = arena_alloc_zero(&p->scratch, sizeof(IndexedObject));
+    if (!e) return NULL;
+    e->obj = obj;
+    p->seen[i] = e;
+    p->seen_count++;
+    return e;
+}
+
+/* Finds 'key' in 'obj' and returns the link to its node. An object looked
+   up more than once gets an index, handed back in '*ix' so the caller keeps
+   it in step with its edits. */
+static JsonNode **patch_find(Patcher *p, JsonValue *obj, const char *key, MemberIndex **ix) {
+    IndexedObject *e = patch_entry(p, obj);
+    *ix = NULL;
+    if (e && !e->ix.slots && e->lookups++ > 0) index_build(p, &e->ix, obj, PATCH_INDEX_MIN);
+    if (e && e->ix.slots) {
+        *ix = &e->ix;
+        JsonNode **link = *index_slot(*ix, key);
+        return link == &kTombstone ? NULL : link;
+    }
+
+    for (JsonNode **link = &obj->as.list.head; *link; link = &(*link)->next) {
+        if (strcmp((*link)->key, key) == 0) return link;
+    }
+    return NULL;
+}
+
+/* Records the member that 'link' now points to, just appended. */
+static void index_added(Patcher *p, MemberIndex *ix, JsonValue *obj, JsonNode **link) {
+    if (!ix) return;
+    if ((ix->used + 1) * 2 > ix->mask + 1) {
+        if (!index_build(p, ix, obj, 0)) ix->slots = NULL; // the next lookup retries
+        return;
+    }
+    index_put(ix, link);
+}
+
+static void member_set(Arena *a, JsonValue *parent, JsonNode *node, JsonValue *val) {
+    node->value = val;
+    if (meta_of(parent)) {
+        meta_attach(a, val, parent);
+        meta_changed(parent);
+    }
+}
+
+/* Unlinks the member or element at 'link' in O(1). Nodes stay where they
+   are; with an index, the next member's entry takes over 'link'. */
+static void member_unlink(JsonValue *parent, JsonNode **link, MemberIndex *ix) {
+    JsonNode *node = *link;
+    JsonNode *next = node->next;
+    if (ix) {
+        *index_slot(ix, node->key) = &kTombstone;
+        ix->live--;
+        if (next) {
+            JsonNode ***slot = index_slot(ix, next->key);
+            if (*slot == &node->next) *slot = link;
+        }
+    }
+    *link = next;
+    if (!next) list_set_tail(NULL, parent, link_owner(parent, link));
+    meta_changed(parent);
+}
+
+static bool member_append(Patcher *p, JsonValue *obj, const char *key, JsonValue *val, MemberIndex *ix) {
+    JsonNode *last = list_last(obj);
+    JsonNode **link = last ? &last->next : &obj->as.list.head;
+    json_list_append(p->a, obj, key, val);
+    if (!*link || (*link)->value != val) return false;
+    if (key) index_added(p, ix, obj, link);
+    return true;
+}
+
+/* --- Merge Patch (RFC 7386) --- */
+
+static JsonValue *merge_patch(Patcher *p, JsonValue *target, const JsonValue *patch) {
+    if (patch->type != JSON_OBJECT) return json_clone(p->a, patch);
+    if (!target || target->type != JSON_OBJECT) {
+        target = json_create_object(p->a);
+        if (!target) return NULL;
+    }
+
+    for (JsonNode *m = patch->as.list.head; m; m = m->next) {
+        MemberIndex *ix;
+        JsonNode **link = patch_find(p, target, m->key, &ix);
+        if (m->value->type == JSON_NULL) {
+            if (link) member_unlink(target, link, ix);
+            continue;
+        }
+
+        // Links and 'ix' stay valid while the recursion edits other objects
+        JsonValue *cur = link ? (*link)->value : NULL;
+        JsonValue *merged = merge_patch(p, cur, m->value); // objects merge in place
+        if (!merged) return NULL;
+        if (!link) {
+            if (!member_append(p, target, m->key, merged, ix)) return NULL;
+        } else if (merged != cur) {
+            member_set(p->a, target, *link, merged);
+        }
+    }
+    return target;
+}
+
+JsonValue *json_merge_patch(Arena *a, JsonValue *target, const JsonValue *patch) {
+    if (!a || !patch) return NULL;
+    Patcher p = {0};
+    p.a = a;
+    JsonValue *result = merge_patch(&p, target, patch);
+    arena_free(&p.scratch);
+    return result;
+}
+
+/* --- JSON Patch (RFC 6902) --- */
+
+static bool array_index(const char *token, size_t *out) {
+    if (!*token || (token[0] == '0' && token[1])) return false;
+    size_t i = 0;
+    for (; *token; token++) {
+        if (*token < '0' || *token > '9' || i > (SIZE_MAX - 9) / 10) return false;
+        i = i * 10 + (size_t)(*token - '0');
+    }
+    *out = i;
+    return true;
+}
+
+/* Unescapes the JSON Pointer token in [s, end) (~1 is '/', ~0 is '~'). */
+static char *pointer_token(Patcher *p, const char *s, const char *end) {
+    char *token = arena_alloc_array(&p->tokens, char, (size_t)(end - s) + 1);
+    if (!token) return NULL;
+    char *d = token;
+    for (; s < end; s++) {
+        if (*s != '~') {
+            *d++ = *s;
+        } else if (s + 1 < end && (s[1] == '0' || s[1] == '1')) {
+            *d++ = s[1] == '0' ? '~' : '/';
+            s++;
+        } else {
+            return NULL;
+        }
+    }
+    *d = '\0';
+    return token;
+}
+
+/* One step down from 'v': the link to the matching member or element. */
+static JsonNode **pointer_step(Patcher *p, JsonValue *v, const char *token, MemberIndex **ix) {
+    *ix = NULL;
+    if (v->type == JSON_OBJECT) return patch_find(p, v, token, ix);
+    if (v->type != JSON_ARRAY) return NULL;
+
+    size_t i;
+    if (!array_index(token, &i)) return NULL;
+    JsonNode **link = &v->as.list.head;
+    for (; *link && i; i--) link = &(*link)->next;
+    return *link ? link : NULL;
+}
+
+/* Resolves every token of 'path' from 'root' ("" is the root itself). */
+static JsonValue *pointer_get(Patcher *p, JsonValue *root, const char *path, size_t len) {
+    const char *s = path, *end = path + len;
+    JsonValue *v = root;
+    while (v && s < end) {
+        if (*s != '/') return NULL;
+        const char *stop = memchr(s + 1, '/', (size_t)(end - s - 1));
+        if (!stop) stop = end;
+        char *token = pointer_token(p, s + 1, stop);
+        MemberIndex *ix;
+        JsonNode **link = token ? pointer_step(p, v, token, &ix) : NULL;
+        v = link ? (*link)->value : NULL;
+        s = stop;
+    }
+    return v;
+}
+
+/* Resolves all but the last token of a non-empty 'path'. */
+static JsonValue *pointer_parent(Patcher *p, JsonValue *root, const char *path, char **last) {
+    size_t len = strlen(path);
+    const char *slash = path + len;
+    while (slash > path && slash[-1] != '/') slash--;
+    if (slash == path) return NULL; // not a pointer
+    *last = pointer_token(p, slash, path + len);
+    if (!*last) return NULL;
+    return pointer_get(p, root, path, (size_t)(slash - 1 - path));
+}
+
+static bool patch_add(Patcher *p, JsonValue **root, const char *path, JsonValue *val) {
+    if (!*path) {
+        *root = val;
+        return true;
+    }
+    char *key;
+    JsonValue *parent = pointer_parent(p, *root, path, &key);
+    if (!parent) return false;
+
+    if (parent->type == JSON_OBJECT) {
+        MemberIndex *ix;
+        JsonNode **link = patch_find(p, parent, key, &ix);
+        if (link) {
+            member_set(p->a, parent, *link, val);
+            return true;
+        }
+        return member_append(p, parent, key, val, ix);
+    }
+    if (parent->type != JSON_ARRAY) return false;
+    if (strcmp(key, "-") == 0) return member_append(p, parent, NULL, val, NULL);
+
+    size_t i;
+    if (!array_index(key, &i)) return false;
+    JsonNode *prev = NULL, *curr = parent->as.list.head;
+    for (; i; i--) {
+        if (!curr) return false;
+        prev = curr;
+        curr = curr->next;
+    }
+    if (!curr) return member_append(p, parent, NULL, val, NULL);
+
+    JsonNode *node = arena_alloc_struct(p->a, JsonNode);
+    if (!node) return false;
+    node->key = NULL;
+    node->value = val;
+    node->next = curr;
+    if (prev) prev->next = node;
+    else parent->as.list.head = node;
+    if (meta_of(parent)) {
+        meta_attach(p->a, val, parent);
+        meta_changed(parent);
+    }
+    return true;
+}
+
+/* Detaches the value at 'path' and returns it. */
+static JsonValue *patch_remove(Patcher *p, JsonValue *root, const char *path) {
+    char *key;
+    JsonValue *parent = *path ? pointer_parent(p, root, path, &key) : NULL;
+    if (!parent) return NULL;
+
+    MemberIndex *ix;
+    JsonNode **link = pointer_step(p, parent, key, &ix);
+    if (!link) return NULL;
+    JsonValue *val = (*link)->value;
+    member_unlink(parent, link, ix);
+    return val;
+}
+
+static bool patch_replace(Patcher *p, JsonValue **root, const char *path, JsonValue *val) {
+    if (!*path) {
+        *root = val;
+        return true;
+    }
+    char *key;
+    JsonValue *parent = pointer_parent(p, *root, path, &key);
+    if (!parent) return false;
+
+    MemberIndex *ix;
+    JsonNode **link = pointer_step(p, parent, key, &ix);
+    if (!link) return false;
+    member_set(p->a, parent, *link, val);
+    return true;
+}
+
+static const char *op_string(JsonValue *op, const char *name) {
+    JsonValue *v = json_get(op, name);
+    return v && v->type == JSON_STRING ? v->as.string : NULL;
+}
+
+static bool patch_op(Patcher *p, JsonValue **root, JsonValue *op) {
+    const char *name = op_string(op, "op");
+    const char *path = op_string(op, "path");
+    if (!name || !path) return false;
+
+    if (strcmp(name, "add") == 0 || strcmp(name, "replace") == 0) {
+        JsonValue *value = json_get(op, "value");
+        JsonValue *copy = value ? json_clone(p->a, value) : NULL;
+        if (!copy) return false;
+        return name[0] == 'a' ? patch_add(p, root, path, copy) : patch_replace(p, root, path, copy);
+    }
+    if (strcmp(name, "remove") == 0) return patch_remove(p, *root, path) != NULL;
+    if (strcmp(name, "test") == 0) {
+        JsonValue *value = json_get(op, "value");
+        JsonValue *cur = pointer_get(p, *root, path, strlen(path));
+        return value && cur && json_equal(cur, value);
+    }
+
+    const char *from = op_string(op, "from");
+    if (!from) return false;
+    if (strcmp(name, "copy") == 0) {
+        JsonValue *src = pointer_get(p, *root, from, strlen(from));
+        JsonValue *copy = src ? json_clone(p->a, src) : NULL;
+        return copy && patch_add(p, root, path, copy);
+    }
+    if (strcmp(name, "move") == 0) {
+        size_t n = strlen(from);
+        if (strcmp(from, path) == 0) return pointer_get(p, *root, from, n) != NULL;
+        if (strncmp(path, from, n) == 0 && path[n] == '/') return false; // into itself
+        JsonValue *val = patch_remove(p, *root, from);
+        return val && patch_add(p, root, path, val);
+    }
+    return false;
+}
+
+JsonValue *json_patch_apply(Arena *a, JsonValue *target, const JsonValue *ops) {
+    if (!a || !target || !ops || ops->type != JSON_ARRAY) return NULL;
+
+    Patcher p = {0};
+    p.a = a;
+    JsonValue *root = target;
+    for (JsonNode *curr = ops->as.list.head; curr && root; curr = curr->next) {
+        arena_reset(&p.tokens);
+        if (curr->value->type != JSON_OBJECT || !patch_op(&p, &root, curr->value)) root = NULL;
+    }
+    arena_free(&p.scratch);
+    arena_free(&p.tokens);
+    return root;
+}
+
+/* --- Diff --- */
+
+typedef struct {
+    Patcher p;        // its scratch holds the member indexes of each diff_object call
+    Arena lists;      // node arrays of the arrays being compared
+    Arena paths;      // the JSON Pointer of the current position
+    char *path;
+    size_t len;
+    size_t cap;
+    JsonValue *ops;
+    bool failed;
+} Differ;
+
+static bool path_grow(Differ *d, size_t n) {
+    if (d->len + n + 1 <= d->cap) return true;
+    size_t cap = d->cap * 2;
+    while (cap < d->len + n + 1) cap *= 2;
+    char *grown = arena_realloc(&d->paths, d->path, d->cap, cap);
+    if (!grown) {
+        d->failed = true;
+        return false;
+    }
+    d->path = grown;
+    d->cap = cap;
+    return true;
+}
+
+/* Appends "/key" with '~' and '/' escaped; returns the old length. */
+static size_t path_push_key(Differ *d, const char *key) {
+    size_t mark = d->len;
+    size_t n = strlen(key);
+    if (!path_grow(d, 1 + 2 * n)) return mark;
+    char *p = d->path + d->len;
+    *p++ = '/';
+    for (; *key; key++) {
+        if (*key == '~' || *key == '/') {
+            *p++ = '~';
+            *p++ = *key == '~' ? '0' : '1';
+        } else {
+            *p++ = *key;
+        }
+    }
+    *p = '\0';
+    d->len = (size_t)(p - d->path);
+    return mark;
+}
+
+static size_t path_push_index(Differ *d, size_t i) {
+    size_t mark = d->len;
+    if (!path_grow(d, 21)) return mark;
+    d->path[d->len++] = '/';
+    d->len += (size_t)fmt_u64(d->path + d->len, i);
+    d->path[d->len] = '\0';
+    return mark;
+}
+
+static void path_pop(Differ *d, size_t mark) {
+    d->len = mark;
+    d->path[mark] = '\0';
+}
+
+static void diff_emit(Differ *d, const char *op, const JsonValue *value) {
+    if (d->failed) return;
+    Arena *a = d->p.a;
+    JsonValue *o = json_create_object(a);
+    JsonValue *path = json_create_string(a, d->path);
+    JsonValue *name = json_create_string_ref(a, op, strlen(op));
+    JsonValue *copy = value ? json_clone(a, value) : NULL;
+    if (!o || !path || !name || (value && !copy)) {
+        d->failed = true;
+        return;
+    }
+    json_add_static(a, o, "op", 2, name);
+    json_add_static(a, o, "path", 4, path);
+    if (copy) json_add_static(a, o, "value", 5, copy);
+    json_append(a, d->ops, o);
+    if (list_last(d->ops)->value != o || list_last(o)->value != (copy ? copy : path)) {
+        d->failed = true;
+    }
+}
+
+/* Equal without looking inside: the same value, or matching cached hashes. */
+static bool diff_pruned(JsonValue *x, JsonValue *y) {
+    if (x == y) return true;
+    JsonMeta *mx = meta_of(x), *my = meta_of(y);
+    return mx && my && mx->hashed && my->hashed && mx->hash == my->hash;
+}
+
+static bool diff_same(Differ *d, JsonValue *x, JsonValue *y) {
+    if (diff_pruned(x, y)) return true;
+    JsonMeta *mx = meta_of(x), *my = meta_of(y);
+    if (mx && my && mx->hashed && my->hashed) return false;
+    return value_equal(x, y, &d->lists);
+}
+
+static void diff_value(Differ *d, JsonValue *x, JsonValue *y);
+
+/* 'key' in 'obj', through 'ix' when it was built. */
+static JsonNode *diff_find(MemberIndex *ix, JsonValue *obj, const char *key) {
+    if (ix->slots) {
+        JsonNode **link = *index_slot(ix, key);
+        return link ? *link : NULL; // a built index has no tombstones
+    }
+    for (JsonNode *curr = obj->as.list.head; curr; curr = curr->next) {
+        if (strcmp(curr->key, key) == 0) return curr;
+    }
+    return NULL;
+}
+
+/* Members in the same order are paired in one pass. Past the first key
+   that differs, each side is looked up in the other; large objects get an
+   index, built once here and freed on return. */
+static void diff_object(Differ *d, JsonValue *x, JsonValue *y) {
+    JsonNode *xs = x->as.list.head, *ys = y->as.list.head;
+    for (; xs && ys && strcmp(xs->key, ys->key) == 0; xs = xs->next, ys = ys->next) {
+        size_t mark = path_push_key(d, xs->key);
+        diff_value(d, xs->value, ys->value);
+        path_pop(d, mark);
+    }
+
+    ArenaTemp temp = arena_temp_begin(&d->p.scratch);
+    MemberIndex ix = {0}, iy = {0};
+    if (xs) index_build(&d->p, &iy, y, PATCH_INDEX_MIN);
+    if (ys) index_build(&d->p, &ix, x, PATCH_INDEX_MIN);
+    for (JsonNode *curr = xs; curr && !d->failed; curr = curr->next) {
+        if (diff_find(&iy, y, curr->key)) continue;
+        size_t mark = path_push_key(d, curr->key);
+        diff_emit(d, "remove", NULL);
+        path_pop(d, mark);
+    }
+    for (JsonNode *curr = ys; curr && !d->failed; curr = curr->next) {
+        JsonNode *old = diff_find(&ix, x, curr->key);
+        size_t mark = path_push_key(d, curr->key);
+        if (old) diff_value(d, old->value, curr->value);
+        else diff_emit(d, "add", curr->value);
+        path_pop(d, mark);
+    }
+    arena_temp_end(temp);
+}
+
+/* Equal elements are trimmed from both ends; the rest are diffed pairwise,
+   and the surplus is added or removed, so an insertion or deletion costs
+   one operation. */
+static void diff_array(Differ *d, JsonValue *x, JsonValue *y) {
+    size_t nx = 0, ny = 0;
+    for (JsonNode *curr = x->as.list.head; curr; curr = curr->next) nx++;
+    for (JsonNode *curr = y->as.list.head; curr; curr = curr->next) ny++;
+
+    ArenaTemp temp = arena_temp_begin(&d->lists);
+    JsonValue **xs = arena_alloc_array(&d->lists, JsonValue *, nx + ny + 1);
+    if (!xs) {
+        d->failed = true;
+        arena_temp_end(temp);
+        return;
+    }
+    JsonValue **ys = xs + nx;
+    size_t i = 0;
+    for (JsonNode *curr = x->as.list.head; curr; curr = curr->next) xs[i++] = curr->value;
+    i = 0;
+    for (JsonNode *curr = y->as.list.head; curr; curr = curr->next) ys[i++] = curr->value;
+
+    size_t pre = 0, suf = 0;
+    while (pre < nx && pre < ny && diff_same(d, xs[pre], ys[pre])) pre++;
+    while (suf < nx - pre && suf < ny - pre && diff_same(d, xs[nx - 1 - suf], ys[ny - 1 - suf])) suf++;
+
+    size_t mx = nx - pre - suf, my = ny - pre - suf;
+    size_t common = mx < my ? mx : my;
+    for (i = 0; i < common && !d->failed; i++) {
+        size_t mark = path_push_index(d, pre + i);
+        diff_value(d, xs[pre + i], ys[pre + i]);
+        path_pop(d, mark);
+    }
+    for (i = common; i < my && !d->failed; i++) {
+        size_t mark = path_push_index(d, pre + i);
+        diff_emit(d, "add", ys[pre + i]);
+        path_pop(d, mark);
+    }
+    for (i = common; i < mx && !d->failed; i++) {
+        size_t mark = path_push_index(d, pre + common); // later ones shift down
+        diff_emit(d, "remove", NULL);
+        path_pop(d, mark);
+    }
+    arena_temp_end(temp);
+}
+
+static void diff_value(Differ *d, JsonValue *x, JsonValue *y) {
+    if (d->failed || diff_pruned(x, y)) return;
+    if (x->type == y->type && x->type == JSON_OBJECT) {
+        diff_object(d, x, y);
+    } else if (x->type == y->type && x->type == JSON_ARRAY) {
+        diff_array(d, x, y);
+    } else if (!value_equal(x, y, &d->lists)) {
+        diff_emit(d, "replace", y);
+    }
+}
+
+JsonValue *json_diff(Arena *a, JsonValue *from, JsonValue *to) {
+    if (!a || !from || !to) return NULL;
+
+    // Tracked trees refresh their cached hashes; only changed paths rehash
+    if (meta_of(from)) value_hash(from);
+    if (meta_of(to)) value_hash(to);
+
+    Differ d = {0};
+    d.p.a = a;
+    ArenaTemp mark = arena_temp_begin(a);
+    d.ops = json_create_array(a);
+    d.cap = 256;
+    d.path = arena_alloc_array(&d.paths, char, d.cap);
+    if (!d.ops || !d.path) {
+        d.failed = true;
+    } else {
+        d.path[0] = '\0';
+        diff_value(&d, from, to);
+    }
+
+    arena_free(&d.p.scratch);
+    arena_free(&d.p.tokens);
+    arena_free(&d.lists);
+    arena_free(&d.paths);
+    if (d.failed) {
+        arena_temp_rollback(mark);
+        return NULL;
+    }
+    return d.ops;
 }
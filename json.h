@@ -4,15 +4,53 @@
 #include "arena.h"
 #include <stdbool.h>
 #include <stddef.h> // for size_t
+#include <stdio.h>  // for FILE
 
 /* --- Error Reporting --- */
+typedef enum {
+    JSON_OK = 0,
+    JSON_ERR_UNEXPECTED_END,
+    JSON_ERR_UNEXPECTED_END_IN_ARRAY,
+    JSON_ERR_UNEXPECTED_END_IN_OBJECT,
+    JSON_ERR_UNEXPECTED_CHARACTER,
+    JSON_ERR_UNTERMINATED_STRING,
+    JSON_ERR_UNTERMINATED_ESCAPE,
+    JSON_ERR_CONTROL_CHARACTER,
+    JSON_ERR_INVALID_ESCAPE,
+    JSON_ERR_INVALID_UNICODE_ESCAPE,
+    JSON_ERR_INVALID_NUMBER,
+    JSON_ERR_INVALID_UTF8,
+    JSON_ERR_MAX_DEPTH,
+    JSON_ERR_EXPECTED_KEY,
+    JSON_ERR_EXPECTED_COLON,
+    JSON_ERR_EXPECTED_COMMA_OR_BRACKET,
+    JSON_ERR_EXPECTED_COMMA_OR_BRACE,
+    JSON_ERR_TRAILING_COMMA_IN_ARRAY,
+    JSON_ERR_TRAILING_COMMA_IN_OBJECT,
+    JSON_ERR_UNCLOSED_ARRAY,
+    JSON_ERR_UNCLOSED_OBJECT,
+    JSON_ERR_TRAILING_GARBAGE
+} JsonErrorCode;
+
+// On failure the parser only records 'code' and 'offset'. 'msg', 'line' and
+// 'col' are filled in on demand by json_error_format(), which needs the input
+// buffer to still be alive.
 typedef struct {
-    char msg[128]; // Error message
-    int line;      // Line number (1-based)
-    int col;       // Column number (1-based)
-    size_t offset; // Raw byte offset from start
+    JsonErrorCode code;     // JSON_OK on success
+    size_t offset;          // Raw byte offset from start
+    const char *input;      // Input that was parsed (for json_error_format)
+    size_t input_len;
+    char msg[128];          // Error message     (set by json_error_format)
+    int line;               // Line number, 1-based   (set by json_error_format)
+    int col;                // Column number, 1-based (set by json_error_format)
 } JsonError;
 
+/* --- Parse Options --- */
+typedef enum {
+    JSON_PARSE_DEFAULT       = 0,
+    JSON_PARSE_VALIDATE_UTF8 = 1 << 0  // Reject input that is not well-formed UTF-8
+} JsonParseFlags;
+
 /* --- Types --- */
 typedef enum {
     JSON_NULL,
@@ -20,11 +58,13 @@ typedef enum {
     JSON_NUMBER,
     JSON_STRING,
     JSON_ARRAY,
-    JSON_OBJECT
+    JSON_OBJECT,
+    JSON_RAW      // Already-serialized, validated JSON text, written verbatim
 } JsonType;
 
 typedef struct JsonValue JsonValue;
 typedef struct JsonNode JsonNode;
+typedef struct JsonMeta JsonMeta;
 
 struct JsonValue {
     JsonType type;
@@ -32,7 +72,12 @@ struct JsonValue {
         bool boolean;
         double number;
         char *string;
-        struct { JsonNode *head; } list; 
+        // meta: bookkeeping allocated on first need: the last node, so the
+        // Builder API appends in O(1), and the state of json_cache_new and
+        // json_track. Nodes may be linked by hand after the last one; after
+        // removing or reordering nodes by hand, call json_invalidate.
+        struct { JsonNode *head; JsonMeta *meta; } list;
+        struct { char *ptr; size_t len; } raw; // not NUL-terminated when borrowed
     } as;
 };
 
@@ -45,14 +90,240 @@ struct JsonNode {
 /* --- API --- */
 
 // UPDATED: Now accepts an optional JsonError pointer.
-// If 'err' is provided and parsing fails, it will be filled with details.
+// If 'err' is provided and parsing fails, it will be filled with the error
+// code and offset; call json_error_format() for a message and line/col.
 JsonValue *json_parse(Arena *a, const char *input, size_t len, JsonError *err);
 
+// Same as json_parse, with JsonParseFlags. By default string bytes are copied
+// as-is; JSON_PARSE_VALIDATE_UTF8 checks the encoding first with a vectorized
+// validator (SSSE3 lookup tables when available, an ASCII fast path otherwise).
+JsonValue *json_parse_ex(Arena *a, const char *input, size_t len, unsigned flags, JsonError *err);
+
+// Chooses which values json_parse_raw keeps as unparsed JSON_RAW text:
+// called for each array element (key == NULL) and object member value, with
+// 'depth' 1 for children of the root. Return true to keep it raw.
+typedef bool (*JsonRawFilter)(void *user, const char *key, int depth);
+
+// Same as json_parse_ex, but values picked by 'filter' are validated and
+// copied as JSON_RAW spans instead of being parsed into nodes, so they can be
+// spliced back into output without a parse/serialize round trip.
+JsonValue *json_parse_raw(Arena *a, const char *input, size_t len, unsigned flags,
+                          JsonRawFilter filter, void *user, JsonError *err);
+
+// Skips the single value at 'input' (leading whitespace allowed) without building
+// anything and returns a pointer just past it, or NULL if it is malformed.
+// With 'validate' the full RFC 8259 grammar is checked. Without it, arrays and
+// objects are skipped by a SIMD scan that only checks string and bracket
+// structure, which is much faster for jumping over subtrees you do not need.
+const char *json_skip_value(const char *input, size_t len, bool validate, JsonError *err);
+
+// Checks that 'input' is exactly one strict RFC 8259 document, accepting and
+// rejecting the same inputs as json_parse, but without an Arena or any nodes.
+bool json_validate(const char *input, size_t len, JsonError *err);
+bool json_validate_ex(const char *input, size_t len, unsigned flags, JsonError *err);
+
+// Static description of an error code.
+const char *json_error_string(JsonErrorCode code);
+
+// Fills err->msg, err->line and err->col from err->code and err->offset and
+// returns err->msg.
+const char *json_error_format(JsonError *err);
+
+// Returns true if 'str' is well-formed UTF-8 (no overlongs, surrogates or
+// code points above U+10FFFF).
+bool json_utf8_valid(const char *str, size_t len);
+
 JsonValue *json_get(JsonValue *obj, const char *key);
 JsonValue *json_at(JsonValue *arr, int index);
 void json_print(JsonValue *v, int indent);
 char *json_to_string(Arena *a, JsonValue *v, bool pretty);
 
+/* --- Serializer Options --- */
+typedef enum {
+    JSON_WRITE_COMPACT   = 0,
+    JSON_WRITE_PRETTY    = 1 << 0,
+    // RFC 8785 (JCS): compact, object keys sorted by UTF-16 code units
+    // without reordering the tree, shortest round-trip numbers in ECMAScript
+    // form, lowercase \u escapes, and JSON_RAW text re-parsed. NaN and
+    // infinities make the write fail. Honored by json_to_string_ex,
+    // json_write_buffer (returns 0 on failure) and the fd/FILE/sink writers.
+    JSON_WRITE_CANONICAL = 1 << 1
+} JsonWriteFlags;
+
+// Receives each chunk of output in order. Return false to abort the write.
+typedef bool (*JsonSinkFn)(void *user, const char *data, size_t len);
+
+// Single pass into an arena buffer that grows as needed. If 'out_len' is
+// given it receives the length of the result (excluding the terminator).
+char *json_to_string_ex(Arena *a, JsonValue *v, unsigned flags, size_t *out_len);
+
+// Same output as json_to_string_ex, produced by 'threads' threads (0 = one
+// per online CPU): subtrees are measured in parallel, laid out with prefix
+// sums, and written in parallel straight into one buffer. Trees too small or
+// too narrow to split are serialized on the calling thread.
+char *json_to_string_parallel(Arena *a, JsonValue *v, unsigned flags, int threads, size_t *out_len);
+
+// Writes into a caller buffer, snprintf-style: the output is truncated to
+// cap - 1 bytes and NUL-terminated, and the return value is the full length
+// it needs (excluding the terminator). A result >= cap means it was cut short.
+size_t json_write_buffer(JsonValue *v, unsigned flags, char *buf, size_t cap);
+
+// Streams the output to a file descriptor or FILE* through a fixed 64 KB
+// buffer, flushing as it goes. Returns false if a write fails.
+bool json_write_fd(int fd, JsonValue *v, unsigned flags);
+bool json_write_file(FILE *f, JsonValue *v, unsigned flags);
+bool json_write_sink(JsonValue *v, unsigned flags, JsonSinkFn sink, void *user);
+
+// Incremental SHA-256. json_sha256_sink is a JsonSinkFn taking the context
+// as 'user', so a document can be hashed as it is written, without ever
+// materializing the text. json_digest hashes the canonical form.
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;
+    unsigned char block[64];
+} JsonSha256;
+
+void json_sha256_init(JsonSha256 *h);
+bool json_sha256_sink(void *user, const char *data, size_t len);
+void json_sha256_final(JsonSha256 *h, unsigned char digest[32]);
+bool json_digest(JsonValue *v, unsigned char digest[32]);
+
+#ifndef _WIN32
+#include <sys/uio.h>
+
+// Compact output as a writev()/sendmsg() vector. Punctuation, numbers and
+// escaped pieces are packed into small arena chunks; clean string runs of
+// 512 bytes or more (and long JSON_RAW text) are referenced in the tree
+// without copying, so the tree must stay alive and unchanged until the
+// vector is written. '*n' can exceed IOV_MAX; write it in batches.
+bool json_to_iovec(Arena *a, JsonValue *v, struct iovec **out, int *n);
+#endif
+
+/* --- Streaming Writer --- */
+// Writes JSON text as it is produced, without building a JsonValue tree.
+// Commas, indentation and nesting are tracked internally; the output is
+// byte-identical to json_to_string_ex for the same document, compact or
+// JSON_WRITE_PRETTY. JSON_WRITE_CANONICAL needs sorted keys, so the
+// constructors return NULL for it.
+typedef struct JsonWriter JsonWriter;
+
+// The writer itself always lives in 'a'. json_writer_new grows the text in
+// 'a' as well; json_writer_new_buffer writes into a caller buffer with the
+// truncation rules of json_write_buffer; the sink and fd variants stage
+// output in a fixed 64 KB buffer and flush it whenever it fills up.
+JsonWriter *json_writer_new(Arena *a, unsigned flags);
+JsonWriter *json_writer_new_buffer(Arena *a, char *buf, size_t cap, unsigned flags);
+JsonWriter *json_writer_new_sink(Arena *a, JsonSinkFn sink, void *user, unsigned flags);
+JsonWriter *json_writer_new_fd(Arena *a, int fd, unsigned flags);
+
+// Each call returns false once the writer has failed: a call out of place
+// (a key outside an object, a value where a key is expected, mismatched
+// end, a second top-level value), nesting deeper than the parser accepts,
+// or an output error. Failures are sticky.
+bool json_writer_begin_object(JsonWriter *w);
+bool json_writer_end_object(JsonWriter *w);
+bool json_writer_begin_array(JsonWriter *w);
+bool json_writer_end_array(JsonWriter *w);
+bool json_writer_key(JsonWriter *w, const char *key);
+bool json_writer_string(JsonWriter *w, const char *str);
+bool json_writer_number(JsonWriter *w, double num);
+bool json_writer_bool(JsonWriter *w, bool b);
+bool json_writer_null(JsonWriter *w);
+bool json_writer_value(JsonWriter *w, JsonValue *v); // splices in a whole tree
+bool json_writer_raw(JsonWriter *w, const char *json, size_t len); // validated, verbatim
+
+// Flushes the sink and checks that exactly one complete value was written
+// (and, for a caller buffer, that it fit). 'out_len' receives the total
+// length of the document, including any bytes that did not fit.
+bool json_writer_finish(JsonWriter *w, size_t *out_len);
+
+// The NUL-terminated text of an arena or buffer writer after
+// json_writer_finish; NULL for sink writers.
+const char *json_writer_text(JsonWriter *w);
+
+/* --- Resumable Serializer --- */
+// Produces the same text as json_to_string_ex a buffer at a time, for
+// non-blocking sockets: fill whatever room the socket has, and call again
+// later. Memory is the serializer itself plus one small frame per level of
+// nesting, allocated in 'a'. The tree must not change until it is done.
+// Compact and JSON_WRITE_PRETTY only: init returns NULL for
+// JSON_WRITE_CANONICAL.
+typedef struct JsonSerializer JsonSerializer;
+
+JsonSerializer *json_serializer_init(Arena *a, JsonValue *root, unsigned flags);
+
+// Writes up to 'cap' bytes into 'buf' (not NUL-terminated) and returns how
+// many. Returns less than 'cap' only when the document is finished (or the
+// arena ran out of memory, in which case json_serializer_done stays false).
+size_t json_serializer_fill(JsonSerializer *s, char *buf, size_t cap);
+
+// True once every byte of the document has been returned by fill.
+bool json_serializer_done(const JsonSerializer *s);
+
+/* --- Templates --- */
+// A response shape compiled once into pre-escaped static text plus typed
+// slots. Slots are string values of the form "{{name:type}}" in the skeleton,
+// with type string, number, bool or json (any JsonValue). Rendering copies the
+// static runs and formats only the slot values.
+typedef enum {
+    JSON_SLOT_STRING,
+    JSON_SLOT_NUMBER,
+    JSON_SLOT_BOOL,
+    JSON_SLOT_VALUE,
+    JSON_SLOT_INVALID    // from json_template_slot_type for an index out of range
+} JsonSlotType;
+
+typedef union {
+    const char *string;  // NULL renders as null
+    double number;
+    bool boolean;
+    JsonValue *value;    // NULL renders as null
+} JsonSlotValue;
+
+typedef struct JsonTemplate JsonTemplate;
+
+// Strings that are not well-formed markers (unknown type, no name) are
+// written as they are; to write a marker literally, start it with "{{=":
+// "{{=id:string}}" renders as "{{id:string}}". Both return NULL if a name is
+// used with two types, or for JSON_WRITE_CANONICAL (only JSON_WRITE_PRETTY
+// is supported). The template does not refer to the skeleton.
+JsonTemplate *json_template_compile(Arena *a, JsonValue *skeleton, unsigned flags);
+JsonTemplate *json_template_parse(Arena *a, const char *text, size_t len, unsigned flags, JsonError *err);
+
+// Slots are numbered 0..count-1 in order of first appearance; a name used
+// several times is one slot. json_template_slot returns -1 for unknown names.
+int json_template_slot_count(const JsonTemplate *t);
+int json_template_slot(const JsonTemplate *t, const char *name);
+JsonSlotType json_template_slot_type(const JsonTemplate *t, int slot);
+
+// 'values' has one entry per slot, read according to the slot's type.
+// Output is identical to serializing the skeleton with the values in place.
+char *json_template_render(Arena *a, const JsonTemplate *t, const JsonSlotValue *values, size_t *out_len);
+size_t json_template_render_buffer(const JsonTemplate *t, const JsonSlotValue *values, char *buf, size_t cap);
+
+/* --- Serialization Cache --- */
+// For trees that are serialized again and again with few changes. The cache
+// remembers each container's output size and where its bytes are in the
+// previous output, so a call allocates once, measures only changed
+// containers, and copies unchanged subtrees with memcpy.
+typedef struct JsonCache JsonCache;
+
+// Attaches bookkeeping to every container of 'root' (allocated in 'a').
+// Builder calls on those containers keep it up to date; after changing a
+// value in place (e.g. v->as.number = 2), call json_invalidate on the
+// container that holds it. Each value must appear in the tree only once.
+// Output is compact or JSON_WRITE_PRETTY; JSON_WRITE_CANONICAL returns NULL.
+JsonCache *json_cache_new(Arena *a, JsonValue *root, unsigned flags);
+
+// Output is owned by the cache and stays valid until the call after next
+// (the cache keeps the previous output to copy from) or json_cache_free.
+const char *json_cache_to_string(JsonCache *c, size_t *out_len);
+void json_cache_free(JsonCache *c);
+
+// Marks 'v' (an array or object) and its ancestors as changed, and forgets
+// its last node, so the next append finds the end of a list edited by hand.
+void json_invalidate(JsonValue *v);
+
 /* --- Builder API --- */
 JsonValue *json_create_null(Arena *a);
 JsonValue *json_create_bool(Arena *a, bool b);
@@ -60,12 +331,29 @@ JsonValue *json_create_number(Arena *a, double num);
 JsonValue *json_create_string(Arena *a, const char *str);
 JsonValue *json_create_array(Arena *a);
 JsonValue *json_create_object(Arena *a);
+// Borrows 'str' instead of copying it: no strlen, no memcpy. It must stay
+// alive and unchanged as long as the tree, and be NUL-terminated at
+// str[len] (a string literal and sizeof - 1 qualify); NULL otherwise.
+JsonValue *json_create_string_ref(Arena *a, const char *str, size_t len);
+// Wraps serialized JSON (one value, surrounding whitespace allowed) so the
+// writers copy it verbatim. Returns NULL if it is not valid JSON. The text is
+// copied into 'a' with surrounding whitespace trimmed; in pretty mode it is
+// not re-indented.
+JsonValue *json_create_raw(Arena *a, const char *json, size_t len);
+// Borrows serialized JSON without copying or checking it, for splicing
+// cached fragments at no cost. The caller vouches that json[0..len) is
+// exactly one valid value with no surrounding whitespace, alive and
+// unchanged as long as the tree; it need not be NUL-terminated.
+JsonValue *json_create_raw_ref(Arena *a, const char *json, size_t len);
 
 void json_add(Arena *a, JsonValue *obj, const char *key, JsonValue *val);
 void json_add_string(Arena *a, JsonValue *obj, const char *key, const char *val);
 void json_add_number(Arena *a, JsonValue *obj, const char *key, double val);
 void json_add_bool(Arena *a, JsonValue *obj, const char *key, bool val);
 void json_add_null(Arena *a, JsonValue *obj, const char *key);
+// json_add with a borrowed key, under the rules of json_create_string_ref:
+//   json_add_static(&a, obj, "id", 2, json_create_number(&a, id));
+void json_add_static(Arena *a, JsonValue *obj, const char *key, size_t key_len, JsonValue *val);
 
 void json_append(Arena *a, JsonValue *arr, JsonValue *val);
 void json_append_string(Arena *a, JsonValue *arr, const char *val);
@@ -73,4 +361,93 @@ void json_append_number(Arena *a, JsonValue *arr, double val);
 void json_append_bool(Arena *a, JsonValue *arr, bool val);
 void json_append_null(Arena *a, JsonValue *arr);
 
+// Bulk builders: one arena allocation per call, with the nodes, values and
+// copied text laid out contiguously. int64 values are stored as doubles
+// (exact up to 2^53). NULL strings become JSON null.
+JsonValue *json_create_number_array(Arena *a, const double *nums, size_t n);
+JsonValue *json_create_int64_array(Arena *a, const int64_t *nums, size_t n);
+JsonValue *json_create_string_array(Arena *a, const char *const *strs, size_t n);
+
+// Appends 'n' members to 'obj' in order; entries with a NULL key or value
+// are skipped, as json_add does. Keys are copied into the same block as
+// the nodes.
+typedef struct {
+    const char *key;
+    JsonValue *value;
+} JsonField;
+
+void json_add_fields(Arena *a, JsonValue *obj, const JsonField *fields, size_t n);
+
+// Savepoints for speculative building. json_rollback() frees everything
+// allocated in 'a' since json_savepoint() and unlinks whatever was appended
+// to 'container' (may be NULL) in the meantime. Values created before the
+// savepoint must not be made to point at values created after it. Members
+// of 'container' may be removed in between (a patch never moves nodes),
+// except the one that was last at the savepoint.
+typedef struct {
+    ArenaTemp mark;
+    JsonValue *container;
+    JsonMeta *meta;
+    JsonNode *last;
+} JsonSavepoint;
+
+JsonSavepoint json_savepoint(Arena *a, JsonValue *container);
+void json_rollback(JsonSavepoint sp);
+
+/* --- Deep Clone --- */
+// Copies 'src' into 'dst' as one block: values and nodes in depth-first
+// order, followed by every key and string (borrowed ones included). The
+// copy shares nothing with the source, so the source arena can be freed;
+// it starts without serialization cache state.
+JsonValue *json_clone(Arena *dst, const JsonValue *src);
+
+// Like json_clone, but identical subtrees (same types, keys, member order
+// and values; -0 and 0 differ) and equal strings and keys are stored once
+// and shared. Meant for long-lived, read-only documents: parse into a
+// scratch arena, dedup into the long-lived one, free the scratch. The
+// result must not be modified or given a JsonCache.
+JsonValue *json_dedup(Arena *dst, const JsonValue *src);
+
+/* --- Hashing & Equality --- */
+// Structural hash: equal trees (json_equal) hash the same, and object
+// member order does not matter. Not stable across platforms or versions.
+uint64_t json_hash(JsonValue *v);
+
+// Deep comparison, ignoring object member order; numbers compare as doubles
+// (so -0 equals 0) and JSON_RAW only equals raw text with the same bytes.
+// Returns at the first difference, and compares same-order members in one
+// pass. Tracked containers whose hashes are cached and differ are unequal
+// without a look inside.
+bool json_equal(JsonValue *a, JsonValue *b);
+
+// Caches json_hash per container of 'root', so unchanged subtrees hash in
+// O(1). The bookkeeping is shared with json_cache_new: builder calls keep it
+// current, and in-place edits need json_invalidate. Each value must appear
+// in the tree only once.
+void json_track(Arena *a, JsonValue *root);
+
+/* --- Patching --- */
+// Both patch 'target' in place and return the resulting root, which differs
+// from 'target' when the whole document is replaced; NULL on failure. New
+// values are copied from the patch into 'a'. Members are replaced and
+// removed without walking or leaking nodes, and objects that a patch visits
+// more than once are looked up through a hash index.
+
+// RFC 7386 JSON Merge Patch. 'target' may be NULL.
+JsonValue *json_merge_patch(Arena *a, JsonValue *target, const JsonValue *patch);
+
+// RFC 6902 JSON Patch: 'ops' is an array of operation objects, applied in
+// order in a single pass. Fails at the first operation that cannot be
+// applied (or a failed "test"), leaving the earlier ones applied; patch a
+// json_clone if the document must stay untouched on failure.
+JsonValue *json_patch_apply(Arena *a, JsonValue *target, const JsonValue *ops);
+
+// The JSON Patch that turns 'from' into 'to', built in 'a' (values are
+// copied). Unchanged subtrees are skipped without a visit when both sides
+// are the same value or are tracked (json_track) with equal hashes, so
+// diffing two tracked snapshots costs about the size of the change plus the
+// siblings along its path. Objects are matched by key, ignoring member
+// order; arrays by position after trimming equal elements at both ends.
+JsonValue *json_diff(Arena *a, JsonValue *from, JsonValue *to);
+
 #endif
@@ -41,6 +41,831 @@ char *read_file_to_arena(Arena *a, const char *filename, size_t *out_len) {
     return buffer;
 }
 
+/* --- Unit Tests --- */
+
+static int unit_checks = 0;
+static int unit_failures = 0;
+
+#define CHECK(cond) do { \
+    unit_checks++; \
+    if (!(cond)) { \
+        unit_failures++; \
+        printf("%-55s | FAIL     | line %d: %s\n", __func__, __LINE__, #cond); \
+    } \
+} while (0)
+
+// Compact serialization of 'v' equals 'expect'.
+static bool json_is(Arena *a, JsonValue *v, const char *expect) {
+    char *text = json_to_string(a, v, false);
+    return text && strcmp(text, expect) == 0;
+}
+
+// Nested containers, escapes, unicode, and awkward numbers.
+static const char *kSample =
+    "{\"name\":\"caf\\u00e9 \\\"bar\\\"\\n\",\"ids\":[1,-0.5,1e300,123456789012,0],"
+    "\"nested\":{\"empty\":{},\"list\":[[],[null,true,false]],\"tab\":\"a\\tb\"},"
+    "\"z\":\"\xF0\x9F\x98\x80\",\"a\":[{\"k\":1},{\"k\":2}]}";
+
+static JsonValue *parse_str(Arena *a, const char *text) {
+    return json_parse(a, text, strlen(text), NULL);
+}
+
+static void test_skip_value(void) {
+    const char *doc = "{\"a\":[1,{\"b\":\"]}\\\"\"}],\"c\":null} tail";
+    const char *end = json_skip_value(doc, strlen(doc), false, NULL);
+    CHECK(end && strcmp(end, " tail") == 0);
+    end = json_skip_value(doc, strlen(doc), true, NULL);
+    CHECK(end && strcmp(end, " tail") == 0);
+
+    JsonError err = {0};
+    CHECK(json_skip_value("[1,[2", 5, false, &err) == NULL);
+    CHECK(err.code == JSON_ERR_UNEXPECTED_END);
+    CHECK(json_skip_value("[\"]", 3, false, &err) == NULL);
+    CHECK(err.code == JSON_ERR_UNTERMINATED_STRING);
+}
+
+static void test_utf8(void) {
+    static const struct { const char *bytes; bool valid; } cases[] = {
+        {"plain ascii", true},
+        {"\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80", true}, // 2-, 3- and 4-byte forms
+        {"\xF4\x8F\xBF\xBF", true},                     // U+10FFFF
+        {"\xC0\xAF", false},                            // overlong '/'
+        {"\xE0\x80\xAF", false},                        // overlong 3-byte
+        {"\xF0\x80\x80\xAF", false},                    // overlong 4-byte
+        {"\xED\xA0\x80", false},                        // surrogate U+D800
+        {"\xF4\x90\x80\x80", false},                    // above U+10FFFF
+        {"\xF5\x80\x80\x80", false},
+        {"\x80", false},                                // stray continuation
+        {"\xC3", false},                                // truncated
+        {"\xE2\x82", false},
+        {"\xE2\x28\xA1", false},                        // bad continuation
+        {"\xFF", false},
+    };
+    // Each case sits at every offset of a 32-byte window to cross block edges.
+    char buf[64];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t n = strlen(cases[i].bytes);
+        for (size_t off = 0; off < 20; off++) {
+            memset(buf, 'x', sizeof(buf));
+            memcpy(buf + off, cases[i].bytes, n);
+            CHECK(json_utf8_valid(buf, off + n + 12) == cases[i].valid);
+            CHECK(json_utf8_valid(buf, off + n) == cases[i].valid);
+        }
+    }
+
+    JsonError err = {0};
+    const char *doc = "[\"ok\", \"bad \xED\xA0\x80\"]";
+    CHECK(json_validate_ex(doc, strlen(doc), JSON_PARSE_VALIDATE_UTF8, &err) == false);
+    CHECK(err.code == JSON_ERR_INVALID_UTF8);
+    CHECK(json_validate(doc, strlen(doc), NULL) == true);
+}
+
+static void test_rollback(void) {
+    Arena a = {0};
+    JsonValue *keep = json_parse(&a, "[1]", 3, NULL);
+
+    // A failure deep into a document gives back every byte it took.
+    size_t n = 0, cap = 200000;
+    char *bad = malloc(cap);
+    bad[n++] = '[';
+    while (n < cap - 32) n += (size_t)sprintf(bad + n, "{\"k\":[1,2,\"s\"]},");
+    n += (size_t)sprintf(bad + n, "x]");
+    ArenaRegion *end = a.end;
+    size_t used = a.end->count;
+    CHECK(json_parse(&a, bad, n, NULL) == NULL);
+    CHECK(a.end == end && end->count == used && end->next == NULL);
+    CHECK(json_is(&a, keep, "[1]"));
+
+    // Reserve regions from before the savepoint survive, so retries reuse them
+    Arena b = {0};
+    bad[n - 2] = '1';
+    CHECK(json_parse(&b, bad, n, NULL) != NULL);
+    arena_reset(&b);
+    bad[n - 2] = 'x';
+    size_t regions = 0, capacity = 0;
+    for (ArenaRegion *r = b.begin; r; r = r->next, regions++) capacity += r->capacity;
+    for (int i = 0; i < 3; i++) {
+        CHECK(json_parse(&b, bad, n, NULL) == NULL);
+        size_t now_regions = 0, now_capacity = 0;
+        for (ArenaRegion *r = b.begin; r; r = r->next, now_regions++) now_capacity += r->capacity;
+        CHECK(regions > 1 && now_regions == regions && now_capacity == capacity);
+        CHECK(b.end == b.begin && b.begin->count == 0);
+    }
+    arena_free(&b);
+    free(bad);
+
+    JsonValue *arr = json_create_array(&a);
+    json_append_number(&a, arr, 1);
+    JsonSavepoint sp = json_savepoint(&a, arr);
+    json_append_number(&a, arr, 2);
+    json_append_string(&a, arr, "three");
+    json_rollback(sp);
+    CHECK(json_is(&a, arr, "[1]"));
+    json_append_number(&a, arr, 4); // the tail was restored too
+    CHECK(json_is(&a, arr, "[1,4]"));
+
+    JsonValue *obj = json_create_object(&a);
+    sp = json_savepoint(&a, obj);
+    json_add_number(&a, obj, "x", 1);
+    json_rollback(sp);
+    CHECK(json_is(&a, obj, "{}"));
+    json_add_bool(&a, obj, "y", true);
+    CHECK(json_is(&a, obj, "{\"y\":true}"));
+    arena_free(&a);
+}
+
+typedef struct {
+    char data[256];
+    size_t len;
+} TestSink;
+
+static bool test_sink(void *user, const char *data, size_t len) {
+    TestSink *t = user;
+    if (t->len + len >= sizeof(t->data)) return false;
+    memcpy(t->data + t->len, data, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+    return true;
+}
+
+static bool write_sample(JsonWriter *w) {
+    return json_writer_begin_object(w) && json_writer_key(w, "a") &&
+           json_writer_begin_array(w) && json_writer_number(w, 1) &&
+           json_writer_string(w, "x\n") && json_writer_end_array(w) &&
+           json_writer_end_object(w);
+}
+
+static void test_writer(void) {
+    const char *expect = "{\"a\":[1,\"x\\n\"]}";
+    size_t n = strlen(expect), len = 0;
+    Arena a = {0};
+    TestSink sink = {0};
+
+    CHECK(json_writer_new(NULL, 0) == NULL);
+    CHECK(json_writer_new_buffer(NULL, sink.data, sizeof(sink.data), 0) == NULL);
+    CHECK(json_writer_new_sink(NULL, test_sink, &sink, 0) == NULL);
+    CHECK(json_writer_new_fd(NULL, 1, 0) == NULL);
+
+    // Streams cannot sort keys, so canonical mode is refused
+    CHECK(json_writer_new(&a, JSON_WRITE_CANONICAL) == NULL);
+    CHECK(json_writer_new_buffer(&a, sink.data, sizeof(sink.data), JSON_WRITE_CANONICAL | JSON_WRITE_PRETTY) == NULL);
+    CHECK(json_writer_new_sink(&a, test_sink, &sink, JSON_WRITE_CANONICAL) == NULL);
+    CHECK(json_writer_new_fd(&a, 1, JSON_WRITE_CANONICAL) == NULL);
+
+    JsonWriter *w = json_writer_new(&a, 0);
+    CHECK(write_sample(w) && json_writer_finish(w, &len));
+    CHECK(len == n && strcmp(json_writer_text(w), expect) == 0);
+
+    // A caller buffer reports the full length but fails when bytes were cut
+    char buf[32];
+    w = json_writer_new_buffer(&a, buf, 0, 0);
+    CHECK(write_sample(w));
+    CHECK(!json_writer_finish(w, &len) && len == n);
+    w = json_writer_new_buffer(&a, buf, 6, 0);
+    CHECK(write_sample(w));
+    CHECK(!json_writer_finish(w, &len) && len == n && strcmp(buf, "{\"a\":") == 0);
+    w = json_writer_new_buffer(&a, buf, n + 1, 0);
+    CHECK(write_sample(w) && json_writer_finish(w, &len) && strcmp(buf, expect) == 0);
+
+    w = json_writer_new_sink(&a, test_sink, &sink, 0);
+    CHECK(write_sample(w) && json_writer_finish(w, &len));
+    CHECK(len == n && strcmp(sink.data, expect) == 0);
+    CHECK(json_writer_text(w) == NULL);
+
+    w = json_writer_new(&a, 0);
+    CHECK(!json_writer_key(w, "k"));        // no object open
+    CHECK(!json_writer_number(w, 1));       // failures are sticky
+    CHECK(!json_writer_finish(w, NULL));
+    w = json_writer_new(&a, 0);
+    CHECK(json_writer_number(w, 1) && !json_writer_number(w, 2));
+    arena_free(&a);
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} GrowSink;
+
+static bool grow_sink(void *user, const char *data, size_t len) {
+    GrowSink *g = user;
+    if (g->len + len > g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 4096;
+        while (cap < g->len + len) cap *= 2;
+        char *grown = realloc(g->data, cap);
+        if (!grown) return false;
+        g->data = grown;
+        g->cap = cap;
+    }
+    memcpy(g->data + g->len, data, len);
+    g->len += len;
+    return true;
+}
+
+typedef struct {
+    JsonValue *doc;
+    GrowSink out;
+    bool ok;
+} SinkJob;
+
+static void *sink_job(void *arg) {
+    SinkJob *job = arg;
+    job->ok = json_write_sink(job->doc, JSON_WRITE_PRETTY, grow_sink, &job->out);
+    return NULL;
+}
+
+static void test_write_sink(void) {
+    Arena a = {0};
+    JsonValue *arr = json_create_array(&a);
+    for (int i = 0; i < 20000; i++) json_append_string(&a, arr, "a string of some length");
+    size_t len = 0;
+    char *expect = json_to_string_ex(&a, arr, JSON_WRITE_PRETTY, &len);
+
+    // Several staging buffers' worth, on a stack smaller than one of them
+    SinkJob job = {arr, {0}, false};
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 48 * 1024);
+    CHECK(pthread_create(&thread, &attr, sink_job, &job) == 0 && pthread_join(thread, NULL) == 0);
+    CHECK(job.ok && job.out.len == len && memcmp(job.out.data, expect, len) == 0);
+    pthread_attr_destroy(&attr);
+    free(job.out.data);
+    arena_free(&a);
+}
+
+static void test_serializer(void) {
+    Arena a = {0};
+    JsonValue *doc = parse_str(&a, kSample);
+    static const unsigned flags[] = {JSON_WRITE_COMPACT, JSON_WRITE_PRETTY};
+    static const size_t chunks[] = {1, 3, 7, 64, 4096};
+    for (size_t f = 0; f < 2; f++) {
+        size_t len = 0;
+        char *expect = json_to_string_ex(&a, doc, flags[f], &len);
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+            JsonSerializer *ser = json_serializer_init(&a, doc, flags[f]);
+            char *out = arena_alloc_array(&a, char, len + 4096);
+            size_t n = 0, got;
+            do {
+                got = json_serializer_fill(ser, out + n, chunks[c]);
+                n += got;
+            } while (got == chunks[c] && n <= len);
+            CHECK(json_serializer_done(ser));
+            CHECK(n == len && memcmp(out, expect, len) == 0);
+        }
+    }
+    // No sorted keys a buffer at a time: canonical mode is refused
+    CHECK(json_serializer_init(&a, doc, JSON_WRITE_CANONICAL) == NULL);
+    CHECK(json_serializer_init(&a, doc, JSON_WRITE_CANONICAL | JSON_WRITE_PRETTY) == NULL);
+    arena_free(&a);
+}
+
+static bool keep_list_raw(void *user, const char *key, int depth) {
+    (void)user;
+    return depth == 1 && key && strcmp(key, "list") == 0;
+}
+
+static void test_raw(void) {
+    Arena a = {0};
+    JsonValue *obj = json_create_object(&a);
+    const char *frag = " \n[1, {\"x\": \"y\"}]\t";
+    JsonValue *raw = json_create_raw(&a, frag, strlen(frag));
+    CHECK(raw && raw->as.raw.len == strlen(frag) - 3);
+    json_add(&a, obj, "copied", raw);
+    CHECK(json_create_raw(&a, "[1,]", 4) == NULL);
+    CHECK(json_create_raw(&a, "1 2", 3) == NULL);
+
+    // Borrowed from the middle of a larger buffer, no terminator after it
+    const char *cache = "XX{\"cached\":true}YY";
+    json_add(&a, obj, "borrowed", json_create_raw_ref(&a, cache + 2, 15));
+    CHECK(json_is(&a, obj, "{\"copied\":[1, {\"x\": \"y\"}],\"borrowed\":{\"cached\":true}}"));
+    char *text = json_to_string(&a, obj, false);
+    CHECK(text && json_validate(text, strlen(text), NULL));
+
+    // Kept raw by the parser, spliced back byte for byte
+    const char *doc = "{\"list\":[1, 2,  3],\"n\":{\"list\":[ 4 ]}}";
+    JsonValue *v = json_parse_raw(&a, doc, strlen(doc), 0, keep_list_raw, NULL, NULL);
+    CHECK(v && json_get(v, "list") && json_get(v, "list")->type == JSON_RAW);
+    CHECK(json_get(json_get(v, "n"), "list")->type == JSON_ARRAY);
+    CHECK(json_is(&a, v, "{\"list\":[1, 2,  3],\"n\":{\"list\":[4]}}"));
+    arena_free(&a);
+}
+
+static void test_template(void) {
+    Arena a = {0};
+    const char *shape =
+        "{\"id\":\"{{id:number}}\",\"name\":\"{{name:string}}\",\"tags\":[\"{{extra:json}}\","
+        "\"{{x}}\",\"{{=id:number}}\",\"{{id:nope}}\"],\"again\":\"{{id:number}}\",\"ok\":\"{{ok:bool}}\"}";
+    static const unsigned flags[] = {JSON_WRITE_COMPACT, JSON_WRITE_PRETTY};
+    for (size_t f = 0; f < 2; f++) {
+        JsonTemplate *t = json_template_parse(&a, shape, strlen(shape), flags[f], NULL);
+        CHECK(t && json_template_slot_count(t) == 4);
+        if (!t) continue;
+        int id = json_template_slot(t, "id"), name = json_template_slot(t, "name");
+        int extra = json_template_slot(t, "extra"), ok = json_template_slot(t, "ok");
+        CHECK(json_template_slot(t, "x") == -1);
+        CHECK(json_template_slot_type(t, id) == JSON_SLOT_NUMBER);
+        CHECK(json_template_slot_type(t, -1) == JSON_SLOT_INVALID);
+        CHECK(json_template_slot_type(t, 4) == JSON_SLOT_INVALID);
+
+        JsonSlotValue v[4];
+        v[id].number = 42;
+        v[name].string = "A \"quoted\"\n name";
+        v[extra].value = parse_str(&a, "{\"deep\":[1,2]}");
+        v[ok].boolean = true;
+        size_t len = 0;
+        char *out = json_template_render(&a, t, v, &len);
+
+        // The same document built by hand serializes identically
+        JsonValue *doc = json_create_object(&a);
+        json_add_number(&a, doc, "id", 42);
+        json_add_string(&a, doc, "name", v[name].string);
+        JsonValue *tags = json_create_array(&a);
+        json_append(&a, tags, v[extra].value);
+        json_append_string(&a, tags, "{{x}}");
+        json_append_string(&a, tags, "{{id:number}}");
+        json_append_string(&a, tags, "{{id:nope}}");
+        json_add(&a, doc, "tags", tags);
+        json_add_number(&a, doc, "again", 42);
+        json_add_bool(&a, doc, "ok", true);
+        size_t expect_len = 0;
+        char *expect = json_to_string_ex(&a, doc, flags[f], &expect_len);
+        CHECK(out && len == expect_len && strcmp(out, expect) == 0);
+
+        char small[8];
+        CHECK(json_template_render_buffer(t, v, small, sizeof(small)) == expect_len);
+        CHECK(strncmp(small, expect, sizeof(small) - 1) == 0);
+    }
+
+    const char *clash = "[\"{{a:string}}\",\"{{a:number}}\"]";
+    CHECK(json_template_parse(&a, clash, strlen(clash), 0, NULL) == NULL);
+    CHECK(json_template_parse(&a, shape, strlen(shape), JSON_WRITE_CANONICAL, NULL) == NULL);
+    CHECK(json_template_compile(&a, parse_str(&a, shape), JSON_WRITE_CANONICAL | JSON_WRITE_PRETTY) == NULL);
+    arena_free(&a);
+}
+
+static void test_iovec(void) {
+    Arena a = {0};
+    JsonValue *doc = parse_str(&a, kSample);
+
+    // Long clean strings and raw text are referenced in place, not copied
+    char *long_str = arena_alloc_array(&a, char, 2001);
+    memset(long_str, 'q', 2000);
+    long_str[2000] = '\0';
+    long_str[1000] = '"';
+    json_add_string(&a, doc, "long", long_str);
+    char *long_raw = arena_alloc_array(&a, char, 3000);
+    size_t n = 0;
+    long_raw[n++] = '[';
+    while (n < 2900) n += (size_t)sprintf(long_raw + n, "12345,");
+    long_raw[n++] = '0';
+    long_raw[n++] = ']';
+    json_add(&a, doc, "raw", json_create_raw_ref(&a, long_raw, n));
+
+    size_t len = 0;
+    char *expect = json_to_string_ex(&a, doc, JSON_WRITE_COMPACT, &len);
+    struct iovec *iov = NULL;
+    int count = 0;
+    CHECK(json_to_iovec(&a, doc, &iov, &count));
+    size_t pos = 0;
+    bool same = true, referenced = false;
+    for (int i = 0; i < count; i++) {
+        same = same && pos + iov[i].iov_len <= len && memcmp(expect + pos, iov[i].iov_base, iov[i].iov_len) == 0;
+        referenced = referenced || iov[i].iov_base == long_raw;
+        pos += iov[i].iov_len;
+    }
+    CHECK(same && pos == len);
+    CHECK(referenced);
+    arena_free(&a);
+}
+
+// Bytes handed out by 'a', up to its current region.
+static size_t arena_used(const Arena *a) {
+    size_t used = 0;
+    for (ArenaRegion *r = a->begin; r; r = r == a->end ? NULL : r->next) used += r->count;
+    return used;
+}
+
+static void test_parallel(void) {
+    Arena a = {0};
+    JsonValue *root = json_create_object(&a);
+    JsonValue *items = json_create_array(&a);
+    const char *raw = "{\"y\":[{\"q\":1,\"p\":2}],\"x\":1E3}";
+    for (int i = 0; i < 1500; i++) {
+        JsonValue *item = parse_str(&a, i % 3 ? kSample : "{\"b\":1.50,\"a\":[1e2,2],\"\\u00e9\":\"x\"}");
+        if (i % 7 == 0) json_add(&a, item, "raw", json_create_raw(&a, raw, strlen(raw)));
+        json_append(&a, items, item);
+    }
+    json_add(&a, root, "items", items);
+    json_add_string(&a, root, "after", "tail");
+    JsonValue *small = parse_str(&a, kSample);
+
+    static const unsigned flags[] = {JSON_WRITE_COMPACT, JSON_WRITE_PRETTY, JSON_WRITE_CANONICAL};
+    static const int threads[] = {1, 2, 8};
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        size_t len = 0, small_len = 0;
+        char *expect = json_to_string_ex(&a, root, flags[f], &len);
+        char *expect_small = json_to_string_ex(&a, small, flags[f], &small_len);
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            size_t got_len = 0;
+            char *got = json_to_string_parallel(&a, root, flags[f], threads[t], &got_len);
+            CHECK(got && got_len == len && strcmp(got, expect) == 0);
+            got = json_to_string_parallel(&a, small, flags[f], threads[t], &got_len);
+            CHECK(got && got_len == small_len && strcmp(got, expect_small) == 0);
+        }
+    }
+
+    // Only the output text stays in the caller's arena
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        size_t before = arena_used(&a), got_len = 0;
+        char *got = json_to_string_parallel(&a, root, flags[f], 8, &got_len);
+        CHECK(got && arena_used(&a) - before <= got_len + 1 + ARENA_ALIGNMENT);
+    }
+
+    // RFC 8785 has no stand-in for NaN, in parallel either
+    json_add_number(&a, json_get(root, "items")->as.list.head->value, "nan", NAN);
+    CHECK(json_to_string_ex(&a, root, JSON_WRITE_CANONICAL, NULL) == NULL);
+    CHECK(json_to_string_parallel(&a, root, JSON_WRITE_CANONICAL, 8, NULL) == NULL);
+    arena_free(&a);
+}
+
+static bool digest_is(const unsigned char digest[32], const char *hex) {
+    char text[65];
+    for (int i = 0; i < 32; i++) sprintf(text + 2 * i, "%02x", digest[i]);
+    return strcmp(text, hex) == 0;
+}
+
+static void test_canonical(void) {
+    static const struct { const char *input, *hex; } vectors[] = {
+        {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+        {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+         "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    };
+    unsigned char digest[32];
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        JsonSha256 h;
+        json_sha256_init(&h);
+        json_sha256_sink(&h, vectors[i].input, strlen(vectors[i].input));
+        json_sha256_final(&h, digest);
+        CHECK(digest_is(digest, vectors[i].hex));
+
+        json_sha256_init(&h); // byte at a time
+        for (const char *p = vectors[i].input; *p; p++) json_sha256_sink(&h, p, 1);
+        json_sha256_final(&h, digest);
+        CHECK(digest_is(digest, vectors[i].hex));
+    }
+
+    Arena a = {0};
+    const char *doc = "{\"numbers\":[333333333.33333329,1E30,4.50,2e-3,0.000001,1e-7,-0,1e21],"
+                      "\"string\":\"\\u20ac$\\u000F\\u000aA'\\u0042\\u0022\\u005c\\\\\\\"\\/\","
+                      "\"literals\":[null,true,false],\"\\u00e9\":1,\"\xF0\x9F\x98\x80\":2,\"\\ufb01\":3,\"a\":{\"z\":1,\"b\":2}}";
+    JsonValue *v = parse_str(&a, doc);
+    const char *expect = "{\"a\":{\"b\":2,\"z\":1},\"literals\":[null,true,false],"
+                         "\"numbers\":[333333333.3333333,1e+30,4.5,0.002,0.000001,1e-7,0,1e+21],"
+                         "\"string\":\"\xE2\x82\xAC$\\u000f\\nA'B\\\"\\\\\\\\\\\"/\","
+                         "\"\xC3\xA9\":1,\"\xF0\x9F\x98\x80\":2,\"\xEF\xAC\x81\":3}";
+    size_t len = 0;
+    char *text = json_to_string_ex(&a, v, JSON_WRITE_CANONICAL | JSON_WRITE_PRETTY, &len);
+    CHECK(text && strcmp(text, expect) == 0);
+
+    JsonSha256 h;
+    json_sha256_init(&h);
+    json_sha256_sink(&h, expect, strlen(expect));
+    unsigned char want[32];
+    json_sha256_final(&h, want);
+    CHECK(json_digest(v, digest) && memcmp(digest, want, 32) == 0);
+    arena_free(&a);
+
+    // Grisu3 and its printf fallback agree with the shortest correctly
+    // rounded printf digits, on bit patterns across the whole range
+    uint64_t x = 88172645463325252ULL;
+    int mismatches = 0, fallbacks = 0;
+    for (int i = 0; i < 20000; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        double d;
+        memcpy(&d, &x, sizeof(d));
+        if (!isfinite(d) || d == 0) continue;
+        d = fabs(d);
+        if (d < 9007199254740992.0 && (double)(uint64_t)d == d) continue; // integer path
+        char got[40], want_digits[24], expect_num[40];
+        int got_len = fmt_double_canonical(got, d);
+        int n = 1, point = 0;
+        while (!digits_at(d, n, want_digits, &point)) n++;
+        int expect_len = fmt_digits(expect_num, want_digits, n, point);
+        if (got_len != expect_len || memcmp(got, expect_num, (size_t)got_len) != 0) mismatches++;
+        int len, K;
+        if (!grisu3(d, want_digits, &len, &K)) fallbacks++;
+    }
+    CHECK(mismatches == 0);
+    CHECK(fallbacks > 0 && fallbacks < 200); // the fallback is exercised, and rare
+}
+
+static void test_append(void) {
+    CHECK(sizeof(void *) != 8 || sizeof(JsonValue) == 24);
+
+    Arena a = {0};
+    JsonValue *parsed = parse_str(&a, "[1,2]");
+    json_append_number(&a, parsed, 3);
+    json_append_number(&a, parsed, 4);
+    CHECK(json_is(&a, parsed, "[1,2,3,4]"));
+
+    double nums[] = {1, 2};
+    JsonValue *bulk = json_create_number_array(&a, nums, 2);
+    json_append_null(&a, bulk);
+    CHECK(json_is(&a, bulk, "[1,2,null]"));
+
+    // Nodes linked by hand after the recorded tail are still found
+    JsonValue *arr = json_create_array(&a);
+    json_append_number(&a, arr, 1);
+    JsonNode *extra = arena_alloc_struct(&a, JsonNode);
+    extra->key = NULL;
+    extra->value = json_create_bool(&a, true);
+    extra->next = NULL;
+    arr->as.list.head->next = extra;
+    json_append_number(&a, arr, 2);
+    CHECK(json_is(&a, arr, "[1,true,2]"));
+
+    // Truncated by hand: json_invalidate makes the next append find the end
+    arr->as.list.head->next = NULL;
+    json_invalidate(arr);
+    json_append_number(&a, arr, 3);
+    CHECK(json_is(&a, arr, "[1,3]"));
+    JsonValue *obj = parse_str(&a, "{\"a\":1,\"b\":2}");
+    json_add_number(&a, obj, "c", 3);
+    obj->as.list.head->next = NULL;
+    json_invalidate(obj);
+    json_add_number(&a, obj, "d", 4);
+    CHECK(json_is(&a, obj, "{\"a\":1,\"d\":4}"));
+    obj->as.list.head = NULL;
+    json_invalidate(obj);
+    json_add_number(&a, obj, "e", 5);
+    CHECK(json_is(&a, obj, "{\"e\":5}"));
+
+    // Tracking takes over a container that already has a tail
+    JsonValue *root = json_create_object(&a);
+    JsonValue *child = json_create_array(&a);
+    for (int i = 0; i < 1000; i++) json_append_number(&a, child, i);
+    json_add(&a, root, "list", child);
+    json_track(&a, root);
+    uint64_t before = json_hash(root);
+    json_append_number(&a, child, 1000);
+    CHECK(json_hash(root) != before);
+    JsonValue *copy = json_clone(&a, root);
+    CHECK(json_equal(copy, root) && json_hash(copy) == json_hash(root));
+    json_append_number(&a, json_get(copy, "list"), 1001);
+    CHECK(!json_equal(copy, root) && json_hash(copy) != json_hash(root));
+
+    JsonValue *small = json_create_array(&a);
+    JsonSavepoint sp = json_savepoint(&a, small); // no tail recorded yet
+    json_append_number(&a, small, 1);
+    json_rollback(sp);
+    json_append_number(&a, small, 2);
+    CHECK(json_is(&a, small, "[2]"));
+    arena_free(&a);
+}
+
+// "{"k0":0,...}" for keys k<from>..k<to-1>, skipping every 'skip'th (0: none).
+static char *members_text(Arena *a, int from, int to, int skip, const char *tail) {
+    char *buf = arena_alloc_array(a, char, 16 * (size_t)(to - from) + strlen(tail) + 3);
+    size_t len = 0;
+    buf[len++] = '{';
+    for (int i = from; i < to; i++) {
+        if (skip && i % skip == 0) continue;
+        len += (size_t)sprintf(buf + len, "%s\"k%d\":%d", len > 1 ? "," : "", i, i);
+    }
+    len += (size_t)sprintf(buf + len, "%s%s}", len > 1 && *tail ? "," : "", tail);
+    return buf;
+}
+
+// Members of object texts 'x' and 'y', in order.
+static char *members_join(Arena *a, const char *x, const char *y) {
+    char *buf = arena_alloc_array(a, char, strlen(x) + strlen(y) + 1);
+    sprintf(buf, "%.*s%s%s", (int)strlen(x) - 1, x, strlen(x) > 2 && strlen(y) > 2 ? "," : "", y + 1);
+    return buf;
+}
+
+static void test_merge_patch(void) {
+    Arena a = {0};
+    // RFC 7386, appendix A (a selection)
+    static const char *rfc[][3] = {
+        {"{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}"},
+        {"{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}"},
+        {"{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}"},
+        {"{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}"},
+        {"[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}"},
+        {"{}", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}"},
+    };
+    for (size_t i = 0; i < sizeof(rfc) / sizeof(rfc[0]); i++) {
+        JsonValue *v = json_merge_patch(&a, parse_str(&a, rfc[i][0]), parse_str(&a, rfc[i][1]));
+        CHECK(json_is(&a, v, rfc[i][2]));
+    }
+
+    // Nested objects in the patch must not disturb the index of the target
+    char nested[256] = "\"new\":{";
+    for (int i = 1; i <= 9; i++) {
+        sprintf(nested + strlen(nested), "%s\"o%d\":{\"x\":1}", i > 1 ? "," : "", i);
+    }
+    strcat(nested, "}");
+    char patch[512];
+    sprintf(patch, "{\"k0\":0,\"k1\":1,%s}", nested);
+    JsonValue *v = json_merge_patch(&a, parse_str(&a, members_text(&a, 0, 20, 0, "")), parse_str(&a, patch));
+    CHECK(json_is(&a, v, members_text(&a, 0, 20, 0, nested)));
+
+    // Removals, updates and additions on a large object, twice through
+    char big[2048];
+    size_t len = (size_t)sprintf(big, "{");
+    for (int i = 0; i < 60; i += 3) len += (size_t)sprintf(big + len, "\"k%d\":null,", i);
+    for (int i = 60; i < 80; i++) len += (size_t)sprintf(big + len, "\"k%d\":%d,", i, i);
+    sprintf(big + len - 1, "}");
+    char *merged = members_join(&a, members_text(&a, 0, 60, 3, ""), members_text(&a, 60, 80, 0, ""));
+    v = json_merge_patch(&a, parse_str(&a, members_text(&a, 0, 60, 0, "")), parse_str(&a, big));
+    CHECK(json_is(&a, v, merged));
+    v = json_merge_patch(&a, v, parse_str(&a, big));
+    CHECK(json_is(&a, v, merged));
+
+    // RFC 6902 on an indexed object: removing the last member moves the tail
+    JsonValue *doc = parse_str(&a, members_text(&a, 0, 20, 0, ""));
+    JsonValue *ops = parse_str(&a,
+        "[{\"op\":\"test\",\"path\":\"/k19\",\"value\":19},{\"op\":\"remove\",\"path\":\"/k19\"},"
+        "{\"op\":\"remove\",\"path\":\"/k0\"},{\"op\":\"add\",\"path\":\"/k20\",\"value\":20},"
+        "{\"op\":\"move\",\"from\":\"/k10\",\"path\":\"/k21\"},{\"op\":\"copy\",\"from\":\"/k21\",\"path\":\"/k0\"}]");
+    doc = json_patch_apply(&a, doc, ops);
+    CHECK(json_is(&a, doc, members_join(&a, members_text(&a, 1, 10, 0, ""),
+                                        members_text(&a, 11, 19, 0, "\"k20\":20,\"k21\":10,\"k0\":10"))));
+
+    // Patching leaves nodes in place, so a savepoint survives a removal
+    Arena b = {0};
+    JsonValue *obj = parse_str(&b, members_text(&b, 0, 20, 0, ""));
+    JsonSavepoint sp = json_savepoint(&b, obj);
+    json_add_number(&b, obj, "k20", 20);
+    obj = json_merge_patch(&b, obj, parse_str(&b, "{\"k5\":null,\"k18\":null,\"k21\":21}"));
+    json_rollback(sp);
+    json_add_number(&b, obj, "k99", 99);
+    CHECK(json_is(&a, obj, members_join(&a, members_text(&a, 0, 5, 0, ""),
+                                        members_join(&a, members_text(&a, 6, 18, 0, ""),
+                                                     members_text(&a, 19, 20, 0, "\"k99\":99")))));
+    arena_free(&b);
+    arena_free(&a);
+}
+
+// Applying json_diff(x, y) to a copy of 'x' gives 'y'; the number of
+// operations is returned, or -1.
+static int diff_roundtrip(Arena *a, JsonValue *x, JsonValue *y) {
+    JsonValue *ops = json_diff(a, x, y);
+    if (!ops) return -1;
+    JsonValue *patched = json_patch_apply(a, json_clone(a, x), ops);
+    if (!patched || !json_equal(patched, y)) return -1;
+    int n = 0;
+    for (JsonNode *curr = ops->as.list.head; curr; curr = curr->next) n++;
+    return n;
+}
+
+// An object of 'n' members "m<i>":{"id":i,"tag":"t<i>"}, in order 'order'.
+static JsonValue *object_of_objects(Arena *a, const int *order, int n) {
+    JsonValue *obj = json_create_object(a);
+    for (int i = 0; i < n; i++) {
+        char key[16];
+        sprintf(key, "m%d", order[i]);
+        JsonValue *member = json_create_object(a);
+        json_add_number(a, member, "id", order[i]);
+        json_add_string(a, member, "tag", key);
+        json_add(a, obj, key, member);
+    }
+    return obj;
+}
+
+static void test_diff(void) {
+    Arena a = {0};
+    static const char *pairs[][2] = {
+        {"{\"a\":1,\"b\":[1,2,3]}", "{\"a\":1,\"b\":[1,2,3]}"},
+        {"{\"a\":1,\"b\":2}", "{\"b\":3,\"c\":{\"d\":[]}}"},
+        {"[1,2,3,4,5]", "[1,2,9,3,4,5]"},
+        {"[1,2,3,4,5]", "[1,2,4,5]"},
+        {"[{\"a\":1},{\"a\":2}]", "[{\"a\":1},{\"a\":2,\"b\":[true]},{\"a\":3}]"},
+        {"{\"a/b\":1,\"c~d\":{\"e\":2}}", "{\"a/b\":2,\"c~d\":{\"e\":3}}"},
+        {"{\"a\":1}", "[1]"},
+    };
+    static const int ops[] = {0, 3, 1, 1, 2, 2, 1};
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        CHECK(diff_roundtrip(&a, parse_str(&a, pairs[i][0]), parse_str(&a, pairs[i][1])) == ops[i]);
+    }
+
+    // Large objects of objects, reversed, with members changed, dropped and added
+    enum { N = 64 };
+    int fwd[N], rev[N + 8];
+    for (int i = 0; i < N; i++) fwd[i] = i;
+    int m = 0;
+    for (int i = N + 7; i >= 0; i--) {
+        if (i < N && i % 5 == 0) continue;
+        rev[m++] = i;
+    }
+    JsonValue *x = object_of_objects(&a, fwd, N);
+    JsonValue *y = object_of_objects(&a, rev, m);
+    int dropped = (N + 4) / 5, added = 8, changed = 0;
+    for (int i = 1; i < N; i += 7) {
+        char key[16];
+        sprintf(key, "m%d", i);
+        JsonValue *member = json_get(y, key);
+        if (!member) continue;
+        json_add_bool(&a, member, "changed", true);
+        changed++;
+    }
+    CHECK(diff_roundtrip(&a, x, y) == dropped + added + changed);
+    CHECK(diff_roundtrip(&a, y, x) == dropped + added + changed);
+
+    // The same with cached hashes pruning unchanged members
+    json_track(&a, x);
+    json_track(&a, y);
+    CHECK(diff_roundtrip(&a, x, y) == dropped + added + changed);
+    CHECK(diff_roundtrip(&a, x, x) == 0);
+    arena_free(&a);
+}
+
+static void test_cache(void) {
+    Arena a = {0};
+    static const unsigned flags[] = {JSON_WRITE_COMPACT, JSON_WRITE_PRETTY};
+    for (size_t f = 0; f < 2; f++) {
+        JsonValue *doc = parse_str(&a, kSample);
+        JsonCache *c = json_cache_new(&a, doc, flags[f]);
+        CHECK(c != NULL);
+        if (!c) continue;
+
+        // Unchanged, after a builder call, and after an in-place edit
+        for (int round = 0; round < 3; round++) {
+            if (round == 1) json_append_number(&a, json_get(json_get(doc, "nested"), "list"), 7);
+            if (round == 2) {
+                JsonValue *ids = json_get(doc, "ids");
+                ids->as.list.head->value->as.number = 2.5;
+                json_invalidate(ids);
+            }
+            size_t len = 0, expect_len = 0;
+            const char *got = json_cache_to_string(c, &len);
+            char *expect = json_to_string_ex(&a, doc, flags[f], &expect_len);
+            CHECK(got && len == expect_len && strcmp(got, expect) == 0);
+        }
+        json_cache_free(c);
+    }
+    CHECK(json_cache_new(&a, parse_str(&a, kSample), JSON_WRITE_CANONICAL) == NULL);
+    arena_free(&a);
+}
+
+static void test_hash_equal(void) {
+    Arena a = {0};
+    JsonValue *x = parse_str(&a, "{\"a\":[1,2,{\"k\":null}],\"b\":\"s\",\"c\":{\"d\":true,\"e\":-0}}");
+    JsonValue *y = parse_str(&a, "{\"c\":{\"e\":0,\"d\":true},\"b\":\"s\",\"a\":[1,2,{\"k\":null}]}");
+    CHECK(json_equal(x, y) && json_hash(x) == json_hash(y));
+
+    static const char *differ[] = {
+        "{\"a\":[2,1,{\"k\":null}],\"b\":\"s\",\"c\":{\"d\":true,\"e\":0}}",  // array order
+        "{\"a\":[1,2,{\"k\":null}],\"b\":\"t\",\"c\":{\"d\":true,\"e\":0}}",  // string
+        "{\"a\":[1,2,{\"k\":null}],\"b\":\"s\",\"c\":{\"d\":true}}",          // missing member
+        "{\"a\":[1,2,{\"k\":null}],\"b\":\"s\",\"c\":{\"d\":true,\"f\":0}}",  // renamed key
+        "{\"a\":[1,2,{\"k\":0}],\"b\":\"s\",\"c\":{\"d\":true,\"e\":0}}",     // type
+    };
+    for (size_t i = 0; i < sizeof(differ) / sizeof(differ[0]); i++) {
+        JsonValue *z = parse_str(&a, differ[i]);
+        CHECK(!json_equal(x, z) && !json_equal(z, x));
+        CHECK(json_hash(x) != json_hash(z));
+    }
+
+    // Cached hashes follow builder edits and json_invalidate
+    json_track(&a, x);
+    json_track(&a, y);
+    CHECK(json_hash(x) == json_hash(y) && json_equal(x, y));
+    JsonValue *inner = json_get(x, "a")->as.list.head->next->next->value;
+    json_add_number(&a, inner, "n", 1);
+    CHECK(json_hash(x) != json_hash(y) && !json_equal(x, y));
+    json_add_number(&a, json_get(y, "a")->as.list.head->next->next->value, "n", 1);
+    CHECK(json_hash(x) == json_hash(y) && json_equal(x, y));
+    json_get(x, "c")->as.list.head->value->as.boolean = false;
+    json_invalidate(json_get(x, "c"));
+    CHECK(json_hash(x) != json_hash(y) && !json_equal(x, y));
+    arena_free(&a);
+}
+
+static void run_unit_tests(void) {
+    test_diff();
+    test_merge_patch();
+    test_hash_equal();
+    test_cache();
+    test_append();
+    test_canonical();
+    test_parallel();
+    test_iovec();
+    test_template();
+    test_raw();
+    test_serializer();
+    test_write_sink();
+    test_writer();
+    test_rollback();
+    test_utf8();
+    test_skip_value();
+}
+
 /* --- Main Logic --- */
 
 int main(int argc, char **argv) {
@@ -49,6 +874,8 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    run_unit_tests();
+
     const char *dir_path = argv[1];
     DIR *d = opendir(dir_path);
     if (!d) {
@@ -98,10 +925,16 @@ int main(int argc, char **argv) {
       
       int success = (root != NULL);
 
+      // The allocation-free validator must agree with the parser on every file
+      int validated = json_validate(json_data, file_len, NULL);
+
       int test_passed = 0;
       const char *status_str = "";
 
-      if (prefix == 'y') {
+      if (validated != success) {
+          test_passed = 0;
+          status_str = "FAIL (json_validate disagrees)";
+      } else if (prefix == 'y') {
           test_passed = success; 
           status_str = test_passed ? "PASS" : "FAIL (Expected Success)";
       } else if (prefix == 'n') {
@@ -119,6 +952,7 @@ int main(int argc, char **argv) {
       if (!test_passed || prefix == 'i') {
           if (!success) {
               // Rejected: Print the specific error message from the parser
+              json_error_format(&err);
               printf("%-55s | REJECTED | %s -> %s (Line %d:%d)\n", 
                      dir->d_name, 
                      status_str,
@@ -136,7 +970,9 @@ int main(int argc, char **argv) {
     arena_free(&a);
 
     printf("--------------------------------------------------\n");
+    failed_tests += unit_failures;
     printf("Summary: %d Files Processed\n", total_files);
+    printf("Unit:    %d Checks, %d Failed\n", unit_checks, unit_failures);
     printf("Passed:  %d\n", passed_tests);
     printf("Failed:  %d\n", failed_tests);
     printf("--------------------------------------------------\n");